@@ -0,0 +1,278 @@
+#ifndef AOT_KERNEL_H_INCLUDED
+#define AOT_KERNEL_H_INCLUDED
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <string>
+#include <stdexcept>
+#include <Eigen/Dense>
+
+#include "inference_engine.h"
+#include "selection.h"
+#include "typedec.h"
+
+/*
+ * Greedy decoder specialized on the dimensions of one model and on the poem shape : `SentNum` lines of `SentLen` words .
+ * `poem_generate codegen` writes a header with the dimensions of a trained model as constants and a function binding
+ * the kernels of it ; the `server_aot` target is compiled with it (see src/CMakeLists.txt) , so every matrix product has
+ * compile-time sizes that the compiler unrolls and vectorizes for the build machine . the poem is kept in fixed-size
+ * arrays and the words of a line are decoded by a fully unrolled loop .
+ * the weights are read from the fp32 storage of the engine the kernel is bound to ; a model with other dimensions
+ * is rejected when the kernel is created .
+ */
+
+namespace aot_detail
+{
+// `f.template apply<Idx>()` for every `Idx` in [Begin , End) , a loop unrolled at compile time
+template <unsigned Begin, unsigned End>
+struct Unroll
+{
+    template <typename F>
+    static void run(F &f)
+    {
+        f.template apply<Begin>();
+        Unroll<Begin + 1U, End>::run(f);
+    }
+};
+
+template <unsigned End>
+struct Unroll<End, End>
+{
+    template <typename F>
+    static void run(F&) {}
+};
+}
+
+template <unsigned WordEmbeddingDim, unsigned EncHDim, unsigned EncLayerNum, unsigned EncHiddenDim,
+    unsigned DecHDim, unsigned DecLayerNum, unsigned SentLen, unsigned SentNum>
+class AotKernel : public GreedyKernel
+{
+public:
+    explicit AotKernel(const InferenceEngine &engine);
+
+    // `first_seq` has `SentLen` words , and the poem of the engine `SentNum` lines
+    void generate(const IndexSeq &first_seq, ScoredPoem &generated_poem, bool need_log_prob = true) const override;
+
+private:
+    static const unsigned EncCombinedDim = EncHDim * EncLayerNum * 2U;
+    static const unsigned EncOutputDim = DecHDim * DecLayerNum;
+    static const std::size_t MaxHistoryLen = 3U;
+    typedef std::array<Index, SentLen> Line;
+    template <unsigned Rows, unsigned Cols>
+    using MatrixMap = Eigen::Map<const Eigen::Matrix<float, Rows, Cols, Eigen::RowMajor>, Eigen::Aligned16>;
+    template <unsigned Dim>
+    using Vector = Eigen::Matrix<float, Dim, 1>;
+    template <unsigned Dim>
+    using VectorMap = Eigen::Map<const Vector<Dim>>;
+    typedef std::array<Vector<EncHDim>, EncLayerNum> EncStates;
+    typedef std::array<Vector<DecHDim>, DecLayerNum> DecStates;
+    typedef std::array<Vector<EncHiddenDim>, MaxHistoryLen> History;
+    typedef Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, DecHDim, Eigen::RowMajor>, Eigen::Aligned16> OutputWeightMap;
+
+    // the state of decoding one line , `apply<GenIdx>` predicts word `GenIdx` of it
+    struct LineDecoder
+    {
+        const AotKernel &kernel;
+        const OutputWeightMap &dec_output_w;
+        DecStates &dec_h;
+        Eigen::VectorXf &dist;
+        ExclusionBitmap &generated_bitmap;
+        Line &line;
+        float &log_prob;
+        bool need_log_prob;
+        const float *pre_word;
+
+        template <unsigned GenIdx>
+        void apply();
+    };
+
+    const InferenceEngine &engine;
+
+    // one step of a stacked RNN of `HDim` , `x` is the first layer input of WordEmbeddingDim
+    template <unsigned HDim, std::size_t LayerNum>
+    static void rnn_step(const RNNWeights &rnn, const float *x, std::array<Vector<HDim>, LayerNum> &H);
+    void encode(const Line &seq, Vector<EncHiddenDim> &enc_hidden_output) const;
+    template <bool Reverse>
+    void encode_direction(const RNNWeights &rnn, const WeightMatrix &start, const Line &seq, EncStates &H) const;
+    void init_decoder(const History &history, std::size_t history_len, DecStates &dec_h) const;
+};
+
+// ---------------- Template Class Implementation -----------------
+
+template <unsigned WordEmbeddingDim, unsigned EncHDim, unsigned EncLayerNum, unsigned EncHiddenDim,
+    unsigned DecHDim, unsigned DecLayerNum, unsigned SentLen, unsigned SentNum>
+AotKernel<WordEmbeddingDim, EncHDim, EncLayerNum, EncHiddenDim, DecHDim, DecLayerNum, SentLen, SentNum>::AotKernel(const InferenceEngine &engine)
+    :engine(engine)
+{
+    if (engine.word_embedding_dim != WordEmbeddingDim || engine.enc_h_dim != EncHDim
+        || engine.enc_stacked_layer_num != EncLayerNum || engine.enc_hidden_layer_output_dim != EncHiddenDim
+        || engine.dec_h_dim != DecHDim || engine.dec_stacked_layer_num != DecLayerNum)
+    {
+        throw std::runtime_error("model dimensions differ from the compiled kernel");
+    }
+    if (engine.get_weight_precision() != WeightPrecision::FP32)
+    {
+        throw std::runtime_error(std::string("compiled kernel needs fp32 weights , not ")
+            + weight_precision_name(engine.get_weight_precision()));
+    }
+}
+
+template <unsigned WordEmbeddingDim, unsigned EncHDim, unsigned EncLayerNum, unsigned EncHiddenDim,
+    unsigned DecHDim, unsigned DecLayerNum, unsigned SentLen, unsigned SentNum>
+template <unsigned HDim, std::size_t LayerNum>
+void AotKernel<WordEmbeddingDim, EncHDim, EncLayerNum, EncHiddenDim, DecHDim, DecLayerNum, SentLen, SentNum>::rnn_step(
+    const RNNWeights &rnn, const float *x, std::array<Vector<HDim>, LayerNum> &H)
+{
+    Vector<HDim> y = VectorMap<HDim>(rnn.hb[0].data);
+    y.noalias() += MatrixMap<HDim, WordEmbeddingDim>(rnn.x2h[0].data) * VectorMap<WordEmbeddingDim>(x);
+    y.noalias() += MatrixMap<HDim, HDim>(rnn.h2h[0].data) * H[0];
+    H[0] = y.array().tanh();
+    for (std::size_t layer_idx = 1; layer_idx < LayerNum; ++layer_idx)
+    {
+        y = VectorMap<HDim>(rnn.hb[layer_idx].data);
+        y.noalias() += MatrixMap<HDim, HDim>(rnn.x2h[layer_idx].data) * H[layer_idx - 1];
+        y.noalias() += MatrixMap<HDim, HDim>(rnn.h2h[layer_idx].data) * H[layer_idx];
+        H[layer_idx] = y.array().tanh();
+    }
+}
+
+template <unsigned WordEmbeddingDim, unsigned EncHDim, unsigned EncLayerNum, unsigned EncHiddenDim,
+    unsigned DecHDim, unsigned DecLayerNum, unsigned SentLen, unsigned SentNum>
+template <bool Reverse>
+void AotKernel<WordEmbeddingDim, EncHDim, EncLayerNum, EncHiddenDim, DecHDim, DecLayerNum, SentLen, SentNum>::encode_direction(
+    const RNNWeights &rnn, const WeightMatrix &start, const Line &seq, EncStates &H) const
+{
+    for (Vector<EncHDim> &h : H) h.setZero();
+    rnn_step<EncHDim, EncLayerNum>(rnn, start.data, H);
+    for (unsigned pos = 0; pos < SentLen; ++pos)
+    {
+        Index word = seq[Reverse ? SentLen - pos - 1U : pos];
+        rnn_step<EncHDim, EncLayerNum>(rnn, engine.words_lookup.data + static_cast<std::size_t>(word) * WordEmbeddingDim, H);
+    }
+}
+
+template <unsigned WordEmbeddingDim, unsigned EncHDim, unsigned EncLayerNum, unsigned EncHiddenDim,
+    unsigned DecHDim, unsigned DecLayerNum, unsigned SentLen, unsigned SentNum>
+void AotKernel<WordEmbeddingDim, EncHDim, EncLayerNum, EncHiddenDim, DecHDim, DecLayerNum, SentLen, SentNum>::encode(const Line &seq,
+    Vector<EncHiddenDim> &enc_hidden_output) const
+{
+    EncStates l2r_h,
+        r2l_h;
+    encode_direction<false>(engine.enc_l2r, engine.enc_SOS, seq, l2r_h);
+    encode_direction<true>(engine.enc_r2l, engine.enc_EOS, seq, r2l_h);
+    // same order as `BIRNNLayer::get_final_h` : l2r layers , then r2l layers
+    Vector<EncCombinedDim> h_combined;
+    for (unsigned layer_idx = 0; layer_idx < EncLayerNum; ++layer_idx)
+    {
+        h_combined.template segment<EncHDim>(layer_idx * EncHDim) = l2r_h[layer_idx];
+        h_combined.template segment<EncHDim>((EncLayerNum + layer_idx) * EncHDim) = r2l_h[layer_idx];
+    }
+    Vector<EncHiddenDim> tmp_output = VectorMap<EncHiddenDim>(engine.enc_hidden_b.data);
+    tmp_output.noalias() += MatrixMap<EncHiddenDim, EncCombinedDim>(engine.enc_hidden_w.data) * h_combined;
+    enc_hidden_output = tmp_output.cwiseMax(0.f); // rectify
+}
+
+template <unsigned WordEmbeddingDim, unsigned EncHDim, unsigned EncLayerNum, unsigned EncHiddenDim,
+    unsigned DecHDim, unsigned DecLayerNum, unsigned SentLen, unsigned SentNum>
+void AotKernel<WordEmbeddingDim, EncHDim, EncLayerNum, EncHiddenDim, DecHDim, DecLayerNum, SentLen, SentNum>::init_decoder(
+    const History &history, std::size_t history_len, DecStates &dec_h) const
+{
+    Vector<EncOutputDim> enc_output = VectorMap<EncOutputDim>(engine.enc_output_b.data);
+    for (std::size_t history_idx = 0; history_idx < history_len; ++history_idx)
+    {
+        enc_output.noalias() += MatrixMap<EncOutputDim, EncHiddenDim>(engine.enc_output_w[history_idx].data) * history[history_idx];
+    }
+    for (unsigned layer_idx = 0; layer_idx < DecLayerNum; ++layer_idx)
+    {
+        dec_h[layer_idx] = enc_output.template segment<DecHDim>(layer_idx * DecHDim).array().tanh();
+    }
+}
+
+template <unsigned WordEmbeddingDim, unsigned EncHDim, unsigned EncLayerNum, unsigned EncHiddenDim,
+    unsigned DecHDim, unsigned DecLayerNum, unsigned SentLen, unsigned SentNum>
+template <unsigned GenIdx>
+void AotKernel<WordEmbeddingDim, EncHDim, EncLayerNum, EncHiddenDim, DecHDim, DecLayerNum, SentLen, SentNum>::LineDecoder::apply()
+{
+    const InferenceEngine &engine = kernel.engine;
+    std::size_t word_dict_size = engine.word_dict_size;
+    rnn_step<DecHDim, DecLayerNum>(engine.dec, pre_word, dec_h);
+    dist = Eigen::Map<const Eigen::VectorXf>(engine.dec_output_b.data, word_dict_size);
+    dist.noalias() += dec_output_w * dec_h[DecLayerNum - 1];
+    float log_z;
+    Index predicted_word = masked_argmax(dist.data(), word_dict_size, generated_bitmap,
+        need_log_prob ? &log_z : nullptr);
+    assert(predicted_word != -1);
+    generated_bitmap.set(predicted_word);
+    if (need_log_prob) log_prob += dist(predicted_word) - log_z;
+    line[GenIdx] = predicted_word;
+    pre_word = engine.words_lookup.data + static_cast<std::size_t>(predicted_word) * WordEmbeddingDim;
+}
+
+template <unsigned WordEmbeddingDim, unsigned EncHDim, unsigned EncLayerNum, unsigned EncHiddenDim,
+    unsigned DecHDim, unsigned DecLayerNum, unsigned SentLen, unsigned SentNum>
+void AotKernel<WordEmbeddingDim, EncHDim, EncLayerNum, EncHiddenDim, DecHDim, DecLayerNum, SentLen, SentNum>::generate(
+    const IndexSeq &first_seq, ScoredPoem &generated_poem, bool need_log_prob) const
+{
+    assert(SentLen == first_seq.size() && SentNum == engine.poem_sent_num);
+    std::size_t word_dict_size = engine.word_dict_size;
+    std::array<Line, SentNum> tmp_poem;
+    std::copy(first_seq.cbegin(), first_seq.cend(), tmp_poem[0].begin());
+    ExclusionBitmap generated_bitmap(word_dict_size);
+    // the newest encoder output first , as the history of the generic engine
+    History history;
+    std::size_t history_len = 0U;
+    DecStates dec_h;
+    Eigen::VectorXf dist(word_dict_size); // the vocabulary may be too large for a fixed-size vector
+    OutputWeightMap dec_output_w(engine.dec_output_w.data, word_dict_size, DecHDim);
+    float log_prob = need_log_prob ? 0.f : std::numeric_limits<float>::quiet_NaN();
+    for (unsigned generating_idx = 1; generating_idx < SentNum; ++generating_idx)
+    {
+        for (std::size_t history_idx = std::min(history_len, MaxHistoryLen - 1U); history_idx > 0; --history_idx)
+        {
+            history[history_idx] = history[history_idx - 1];
+        }
+        encode(tmp_poem[generating_idx - 1], history[0]);
+        history_len = std::min(history_len + 1U, MaxHistoryLen);
+        init_decoder(history, history_len, dec_h);
+        LineDecoder line_decoder{ *this, dec_output_w, dec_h, dist, generated_bitmap, tmp_poem[generating_idx],
+            log_prob, need_log_prob, engine.dec_SOS.data };
+        aot_detail::Unroll<0U, SentLen>::run(line_decoder);
+    }
+    generated_poem.poem.resize(SentNum);
+    for (unsigned sent_idx = 0; sent_idx < SentNum; ++sent_idx)
+    {
+        generated_poem.poem[sent_idx].assign(tmp_poem[sent_idx].cbegin(), tmp_poem[sent_idx].cend());
+    }
+    generated_poem.log_prob = log_prob;
+}
+
+template <unsigned WordEmbeddingDim, unsigned EncHDim, unsigned EncLayerNum, unsigned EncHiddenDim,
+    unsigned DecHDim, unsigned DecLayerNum, unsigned SentNum>
+void set_aot_kernels_of(InferenceEngine &engine)
+{
+    engine.set_greedy_kernel(5U, std::make_shared<AotKernel<WordEmbeddingDim, EncHDim, EncLayerNum, EncHiddenDim,
+        DecHDim, DecLayerNum, 5U, SentNum>>(engine));
+    engine.set_greedy_kernel(7U, std::make_shared<AotKernel<WordEmbeddingDim, EncHDim, EncLayerNum, EncHiddenDim,
+        DecHDim, DecLayerNum, 7U, SentNum>>(engine));
+}
+
+// binds the kernels of five and seven character lines , for the line count set on `engine` ; lines of other lengths
+// keep the generic decoders . throws if the model does not fit the kernels , or the line count is not 4 or 8
+template <unsigned WordEmbeddingDim, unsigned EncHDim, unsigned EncLayerNum, unsigned EncHiddenDim,
+    unsigned DecHDim, unsigned DecLayerNum>
+void set_aot_kernels(InferenceEngine &engine)
+{
+    if (4U == engine.poem_sent_num)
+    {
+        set_aot_kernels_of<WordEmbeddingDim, EncHDim, EncLayerNum, EncHiddenDim, DecHDim, DecLayerNum, 4U>(engine);
+    }
+    else if (8U == engine.poem_sent_num)
+    {
+        set_aot_kernels_of<WordEmbeddingDim, EncHDim, EncLayerNum, EncHiddenDim, DecHDim, DecLayerNum, 8U>(engine);
+    }
+    else throw std::runtime_error("compiled kernels are for poems of 4 or 8 lines , not " + std::to_string(engine.poem_sent_num));
+}
+
+#endif
@@ -0,0 +1,130 @@
+#include "batch_scheduler.h"
+
+#include <map>
+#include <cassert>
+#include <algorithm>
+
+using namespace std;
+
+BatchScheduler::BatchScheduler(const InferenceEngine &engine, size_t max_batch_size)
+    :engine(engine), max_batch_size(std::max<size_t>(max_batch_size, 1U)), next_id(1U), sample_buf(MaxSampleCandidates)
+{}
+
+BatchScheduler::RequestId BatchScheduler::submit(const IndexSeq &first_seq, const DecodeOptions &opts)
+{
+    assert(!opts.use_shortlist); // decoded on its own , see `InferenceEngine::generate`
+    unique_ptr<Sequence> seq(new Sequence());
+    seq->id = next_id++;
+    seq->poem.assign(engine.poem_sent_num, IndexSeq(first_seq.size()));
+    seq->poem[0] = first_seq;
+    seq->generating_idx = 1U;
+    seq->gen_idx = 0U;
+    seq->line_ready = false;
+    seq->pre_word = -1;
+    seq->has_generated_bitmap.reset(engine.word_dict_size);
+    seq->sampling = opts.sampling;
+    seq->rng.seed(opts.seed);
+    RequestId id = seq->id;
+    pending.push_back(std::move(seq));
+    return id;
+}
+
+void BatchScheduler::cancel(RequestId request_id)
+{
+    auto has_id = [request_id](const unique_ptr<Sequence> &seq) { return seq->id == request_id; };
+    pending.erase(remove_if(pending.begin(), pending.end(), has_id), pending.end());
+    active.erase(remove_if(active.begin(), active.end(), has_id), active.end());
+}
+
+void BatchScheduler::start_lines()
+{
+    // group sequences at the start of a line by (line index , line length) so they share one encoder batch
+    map<pair<size_t, size_t>, vector<Sequence*>> groups;
+    for (unique_ptr<Sequence> &seq : active)
+    {
+        if (!seq->line_ready) groups[make_pair(seq->generating_idx, seq->poem[0].size())].push_back(seq.get());
+    }
+    for (auto &group : groups)
+    {
+        vector<Sequence*> &seqs = group.second;
+        size_t generating_idx = group.first.first,
+            group_size = seqs.size(),
+            history_len = seqs[0]->history.size();
+        vector<IndexSeq> cur_seqs(group_size);
+        deque<Eigen::MatrixXf> history(history_len, Eigen::MatrixXf(engine.enc_hidden_layer_output_dim, group_size));
+        for (size_t seq_idx = 0; seq_idx < group_size; ++seq_idx)
+        {
+            cur_seqs[seq_idx] = seqs[seq_idx]->poem[generating_idx - 1U];
+            for (size_t history_idx = 0; history_idx < history_len; ++history_idx)
+            {
+                history[history_idx].col(seq_idx) = seqs[seq_idx]->history[history_idx];
+            }
+        }
+        vector<Eigen::MatrixXf> group_dec_h;
+        engine.prepare_decoder(cur_seqs, generating_idx, history, group_dec_h);
+        for (size_t seq_idx = 0; seq_idx < group_size; ++seq_idx)
+        {
+            Sequence &seq = *seqs[seq_idx];
+            seq.history.resize(history.size());
+            for (size_t history_idx = 0; history_idx < history.size(); ++history_idx)
+            {
+                seq.history[history_idx] = history[history_idx].col(seq_idx);
+            }
+            seq.dec_h.resize(group_dec_h.size());
+            for (size_t layer_idx = 0; layer_idx < group_dec_h.size(); ++layer_idx)
+            {
+                seq.dec_h[layer_idx] = group_dec_h[layer_idx].col(seq_idx);
+            }
+            seq.line_ready = true;
+            seq.pre_word = -1;
+        }
+    }
+}
+
+void BatchScheduler::step(vector<FinishedPoem> &finished)
+{
+    // requests join the batch only at the character step boundary
+    while (!pending.empty() && active.size() < max_batch_size)
+    {
+        active.push_back(std::move(pending.front()));
+        pending.pop_front();
+    }
+    if (active.empty()) return;
+    start_lines();
+
+    size_t batch_size = active.size();
+    pre_words.resize(batch_size);
+    dec_h.resize(engine.dec_stacked_layer_num);
+    for (Eigen::MatrixXf &h : dec_h) h.resize(engine.dec_h_dim, batch_size);
+    for (size_t seq_idx = 0; seq_idx < batch_size; ++seq_idx)
+    {
+        const Sequence &seq = *active[seq_idx];
+        pre_words[seq_idx] = seq.pre_word;
+        for (size_t layer_idx = 0; layer_idx < dec_h.size(); ++layer_idx) dec_h[layer_idx].col(seq_idx) = seq.dec_h[layer_idx];
+    }
+    engine.decode_step(pre_words, dec_h, dist);
+
+    vector<unique_ptr<Sequence>> still_active;
+    still_active.reserve(batch_size);
+    for (size_t seq_idx = 0; seq_idx < batch_size; ++seq_idx)
+    {
+        unique_ptr<Sequence> &seq = active[seq_idx];
+        // same rule as `InferenceEngine::sample_batch` : never repeat a word generated before
+        Index predicted_word_idx = masked_sample(dist.col(seq_idx).data(), dist.rows(), seq->has_generated_bitmap,
+            seq->sampling, seq->rng, sample_buf.data());
+        assert(predicted_word_idx != -1);
+        seq->has_generated_bitmap.set(predicted_word_idx);
+        seq->poem[seq->generating_idx][seq->gen_idx] = predicted_word_idx;
+        seq->pre_word = predicted_word_idx;
+        for (size_t layer_idx = 0; layer_idx < dec_h.size(); ++layer_idx) seq->dec_h[layer_idx] = dec_h[layer_idx].col(seq_idx);
+        if (++seq->gen_idx == seq->poem[0].size())
+        {
+            seq->gen_idx = 0U;
+            seq->line_ready = false;
+            ++seq->generating_idx;
+        }
+        if (seq->generating_idx == seq->poem.size()) finished.push_back(FinishedPoem(seq->id, std::move(seq->poem)));
+        else still_active.push_back(std::move(seq));
+    }
+    swap(active, still_active);
+}
@@ -0,0 +1,71 @@
+#ifndef BATCH_SCHEDULER_H_INCLUDED
+#define BATCH_SCHEDULER_H_INCLUDED
+#include <vector>
+#include <deque>
+#include <memory>
+#include <utility>
+#include <random>
+#include <Eigen/Dense>
+
+#include "inference_engine.h"
+#include "selection.h"
+#include "typedec.h"
+
+/*
+ * Iteration-level (continuous) batching of greedy and sampling generation requests on the native engine .
+ * every `step` advances all active sequences by one character :
+ * new requests join the batch at that boundary , finished poems leave it ,
+ * and the decoder RNN and output layer run as one matrix-matrix product over the whole batch .
+ * sequences starting a new line are encoded together , grouped by line index and length .
+ * the output layer is the full vocabulary one shared by the batch : shortlisted requests are not taken .
+ * deadlines are left to the caller (see `SchedulerThread`) .
+ * not thread-safe ; driven by one loop .
+ */
+class BatchScheduler
+{
+public:
+    using RequestId = unsigned long long;
+    using FinishedPoem = std::pair<RequestId, Poem>;
+
+    BatchScheduler(const InferenceEngine &engine, std::size_t max_batch_size);
+
+    // greedy or sampling requests without a shortlist , beam width and deadline are ignored
+    RequestId submit(const IndexSeq &first_seq, const DecodeOptions &opts = DecodeOptions());
+    void cancel(RequestId request_id);
+    void step(std::vector<FinishedPoem> &finished);
+
+    bool idle() const { return active.empty() && pending.empty(); }
+    std::size_t active_size() const { return active.size(); }
+    std::size_t pending_size() const { return pending.size(); }
+
+private:
+    struct Sequence
+    {
+        RequestId id;
+        Poem poem;
+        std::size_t generating_idx; // line being generated
+        std::size_t gen_idx; // character being generated in the line
+        bool line_ready; // encoder has run for the current line
+        Index pre_word; // -1 for SOS
+        std::deque<Eigen::VectorXf> history;
+        std::vector<Eigen::VectorXf> dec_h;
+        ExclusionBitmap has_generated_bitmap;
+        SamplingParams sampling;
+        std::mt19937_64 rng;
+    };
+
+    const InferenceEngine &engine;
+    std::size_t max_batch_size;
+    RequestId next_id;
+    std::deque<std::unique_ptr<Sequence>> pending;
+    std::vector<std::unique_ptr<Sequence>> active;
+    // batch buffers , reused between steps
+    IndexSeq pre_words;
+    Eigen::MatrixXf dist;
+    std::vector<Eigen::MatrixXf> dec_h;
+    std::vector<ScoredIndex> sample_buf;
+
+    void start_lines();
+};
+
+#endif
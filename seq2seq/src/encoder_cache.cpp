@@ -0,0 +1,47 @@
+#include "encoder_cache.h"
+
+using namespace std;
+
+EncoderStateCache::EncoderStateCache(size_t capacity)
+    :max_size(capacity), hit_cnt(0), miss_cnt(0)
+{}
+
+shared_ptr<const EncoderState> EncoderStateCache::get(const IndexSeq &first_seq)
+{
+    lock_guard<mutex> lock(mtx);
+    auto ite = entries.find(first_seq);
+    if (ite == entries.end())
+    {
+        ++miss_cnt;
+        return nullptr;
+    }
+    ++hit_cnt;
+    lru_list.splice(lru_list.begin(), lru_list, ite->second);
+    return ite->second->second;
+}
+
+void EncoderStateCache::put(const IndexSeq &first_seq, shared_ptr<const EncoderState> state)
+{
+    if (0U == max_size) return;
+    lock_guard<mutex> lock(mtx);
+    auto ite = entries.find(first_seq);
+    if (ite != entries.end())
+    {
+        ite->second->second = state;
+        lru_list.splice(lru_list.begin(), lru_list, ite->second);
+        return;
+    }
+    lru_list.emplace_front(first_seq, state);
+    entries[first_seq] = lru_list.begin();
+    if (lru_list.size() > max_size)
+    {
+        entries.erase(lru_list.back().first);
+        lru_list.pop_back();
+    }
+}
+
+size_t EncoderStateCache::size() const
+{
+    lock_guard<mutex> lock(mtx);
+    return lru_list.size();
+}
@@ -0,0 +1,57 @@
+#ifndef ENCODER_CACHE_H_INCLUDED
+#define ENCODER_CACHE_H_INCLUDED
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <Eigen/Dense>
+
+#include "typedec.h"
+
+/*
+ * Bounded , thread-safe LRU cache of the encoder output and the decoder init states of a first line .
+ * the first line is the only input of a request , so a hit skips the whole first encoder pass .
+ */
+
+struct EncoderState
+{
+    Eigen::MatrixXf enc_hidden_output; // {enc_hidden_layer_output_dim , 1}
+    std::vector<Eigen::MatrixXf> dec_init_h; // dec_stacked_layer_num * {dec_h_dim , 1}
+};
+
+struct IndexSeqHash
+{
+    std::size_t operator()(const IndexSeq &seq) const
+    {
+        std::size_t seed = seq.size();
+        for (Index idx : seq) seed ^= static_cast<std::size_t>(idx) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+        return seed;
+    }
+};
+
+class EncoderStateCache
+{
+public:
+    explicit EncoderStateCache(std::size_t capacity);
+
+    std::shared_ptr<const EncoderState> get(const IndexSeq &first_seq);
+    void put(const IndexSeq &first_seq, std::shared_ptr<const EncoderState> state);
+
+    std::size_t capacity() const { return max_size; }
+    std::size_t size() const;
+    unsigned long long hits() const { return hit_cnt; }
+    unsigned long long misses() const { return miss_cnt; }
+
+private:
+    using Entry = std::pair<IndexSeq, std::shared_ptr<const EncoderState>>;
+    std::size_t max_size;
+    std::list<Entry> lru_list; // most recently used at front
+    std::unordered_map<IndexSeq, std::list<Entry>::iterator, IndexSeqHash> entries;
+    mutable std::mutex mtx;
+    std::atomic<unsigned long long> hit_cnt;
+    std::atomic<unsigned long long> miss_cnt;
+};
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef GRAPH_REPLAY_H_INCLUDED
+#define GRAPH_REPLAY_H_INCLUDED
+#include <map>
+#include <memory>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "poem_generate.h"
+#include "typedec.h"
+
+/*
+ * Computation graphs replayed with new indices .
+ * every poem of the same shape (line length , line count) gives the same graph topology , only the lookup indices differ .
+ * a graph is built once with its lookups reading index buffers , and replayed by rewriting the buffers and running
+ * the forward pass again : no node is allocated and no expression is built per poem .
+ * cnn allows one computation graph at a time , so a replayer owns the only graph while it lives ,
+ * and a poem of another shape replaces it .
+ */
+
+// {line length , line count} , line length 0 if the lines differ in length
+typedef std::pair<std::size_t, std::size_t> PoemShape;
+
+inline PoemShape get_poem_shape(const Poem &poem)
+{
+    std::size_t sent_len = poem.empty() ? 0U : poem[0].size();
+    for (const IndexSeq &sent : poem)
+    {
+        if (sent.size() != sent_len) return PoemShape(0U, poem.size());
+    }
+    return PoemShape(sent_len, poem.size());
+}
+
+// regroup a shuffled order into runs of up to `run_len` poems of one shape , so a training graph is replayed along a run
+inline void group_runs_by_shape(const std::vector<Poem> &poems, std::vector<std::size_t> &access_order, std::size_t run_len)
+{
+    std::vector<std::size_t> tmp_order;
+    tmp_order.reserve(access_order.size());
+    std::map<PoemShape, std::vector<std::size_t>> pending_runs;
+    for (std::size_t access_idx : access_order)
+    {
+        std::vector<std::size_t> &run = pending_runs[get_poem_shape(poems.at(access_idx))];
+        run.push_back(access_idx);
+        if (run.size() < run_len) continue;
+        tmp_order.insert(tmp_order.end(), run.begin(), run.end());
+        run.clear();
+    }
+    for (const auto &pending_run : pending_runs)
+    {
+        tmp_order.insert(tmp_order.end(), pending_run.second.begin(), pending_run.second.end());
+    }
+    swap(tmp_order, access_order);
+}
+
+template <typename RNNType>
+class LossGraphReplay
+{
+public:
+    explicit LossGraphReplay(PoemGenerator<RNNType> &pg);
+
+    // loss of `poem` ; the graph is rebuilt only if the shape differs from the last poem
+    cnn::real forward(const Poem &poem);
+    void backward() { cg->backward(); }
+
+    unsigned long long get_build_cnt() const { return build_cnt; }
+    unsigned long long get_replay_cnt() const { return replay_cnt; }
+
+private:
+    PoemGenerator<RNNType> &pg;
+    std::unique_ptr<cnn::ComputationGraph> cg;
+    PoemShape shape;
+    std::vector<std::vector<unsigned>> words; // read by the lookups and losses of `cg`
+    unsigned long long build_cnt;
+    unsigned long long replay_cnt;
+};
+
+template <typename RNNType>
+class GenerateGraphReplay
+{
+public:
+    explicit GenerateGraphReplay(PoemGenerator<RNNType> &pg);
+
+    // greedy generation ; the graph is rebuilt only if the shape differs from the last request
+    void generate(const IndexSeq &first_seq, Poem &generated_poem, std::size_t sent_num = PoemGenerator<RNNType>::PoemSentNum);
+
+    unsigned long long get_build_cnt() const { return build_cnt; }
+    unsigned long long get_replay_cnt() const { return replay_cnt; }
+
+private:
+    PoemGenerator<RNNType> &pg;
+    std::unique_ptr<cnn::ComputationGraph> cg;
+    PoemShape shape;
+    std::vector<std::vector<unsigned>> words;
+    std::vector<std::vector<cnn::VariableIndex>> dist_nodes;
+    unsigned long long build_cnt;
+    unsigned long long replay_cnt;
+};
+
+// ---------------- Template Class Implementation -----------------
+
+template <typename RNNType>
+LossGraphReplay<RNNType>::LossGraphReplay(PoemGenerator<RNNType> &pg)
+    :pg(pg), shape(0U, 0U), build_cnt(0), replay_cnt(0)
+{}
+
+template <typename RNNType>
+cnn::real LossGraphReplay<RNNType>::forward(const Poem &poem)
+{
+    PoemShape poem_shape = get_poem_shape(poem);
+    bool is_replay = cg && 0U != poem_shape.first && poem_shape == shape;
+    if (!is_replay)
+    {
+        cg.reset(); // the old graph goes first
+        words.assign(poem.size(), std::vector<unsigned>());
+        for (std::size_t sent_idx = 0; sent_idx < poem.size(); ++sent_idx) words[sent_idx].resize(poem[sent_idx].size());
+    }
+    for (std::size_t sent_idx = 0; sent_idx < poem.size(); ++sent_idx)
+    {
+        std::copy(poem[sent_idx].cbegin(), poem[sent_idx].cend(), words[sent_idx].begin());
+    }
+    if (is_replay) ++replay_cnt;
+    else
+    {
+        cg.reset(new cnn::ComputationGraph());
+        pg.build_replayable_graph(*cg, words);
+        shape = poem_shape;
+        ++build_cnt;
+    }
+    return as_scalar(cg->forward());
+}
+
+template <typename RNNType>
+GenerateGraphReplay<RNNType>::GenerateGraphReplay(PoemGenerator<RNNType> &pg)
+    :pg(pg), shape(0U, 0U), build_cnt(0), replay_cnt(0)
+{}
+
+template <typename RNNType>
+void GenerateGraphReplay<RNNType>::generate(const IndexSeq &first_seq, Poem &generated_poem, std::size_t sent_num)
+{
+    PoemShape poem_shape(first_seq.size(), sent_num);
+    if (cg && poem_shape == shape) ++replay_cnt;
+    else
+    {
+        cg.reset();
+        words.assign(poem_shape.second, std::vector<unsigned>(poem_shape.first));
+        cg.reset(new cnn::ComputationGraph());
+        pg.build_generation_graph(*cg, words, dist_nodes);
+        shape = poem_shape;
+        ++build_cnt;
+    }
+    pg.run_generation_graph(*cg, words, dist_nodes, first_seq, generated_poem);
+}
+
+#endif
@@ -0,0 +1,56 @@
+#include "helper_thread.h"
+
+using namespace std;
+
+HelperThread::HelperThread()
+    :busy(false), done(false), stopping(false)
+{
+    worker = thread(&HelperThread::run, this);
+}
+
+HelperThread::~HelperThread()
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        stopping = true;
+    }
+    task_cv.notify_one();
+    worker.join();
+}
+
+bool HelperThread::start(function<void()> new_task)
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        if (busy) return false;
+        busy = true;
+        done = false;
+        task = std::move(new_task);
+    }
+    task_cv.notify_one();
+    return true;
+}
+
+void HelperThread::wait()
+{
+    unique_lock<mutex> lock(mtx);
+    done_cv.wait(lock, [this]{ return done; });
+    busy = false;
+}
+
+void HelperThread::run()
+{
+    unique_lock<mutex> lock(mtx);
+    while (true)
+    {
+        task_cv.wait(lock, [this]{ return stopping || (busy && task); });
+        if (stopping) return;
+        function<void()> cur_task;
+        swap(cur_task, task);
+        lock.unlock();
+        cur_task();
+        lock.lock();
+        done = true;
+        done_cv.notify_one();
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef HELPER_THREAD_H_INCLUDED
+#define HELPER_THREAD_H_INCLUDED
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+/*
+ * One long-lived thread that runs a task next to its caller , e.g. the right-to-left encoder direction .
+ * it takes one task at a time : a caller that finds it busy runs its work inline instead of waiting .
+ */
+class HelperThread
+{
+public:
+    HelperThread();
+    ~HelperThread();
+    HelperThread(const HelperThread&) = delete;
+    HelperThread &operator=(const HelperThread&) = delete;
+
+    // false if another task is running , `task` is not started then
+    bool start(std::function<void()> task);
+    // blocks until the started task is done
+    void wait();
+
+private:
+    std::mutex mtx;
+    std::condition_variable task_cv;
+    std::condition_variable done_cv;
+    std::function<void()> task;
+    bool busy; // a task is started and not waited for yet
+    bool done;
+    bool stopping;
+    std::thread worker;
+
+    void run();
+};
+
+// a task started on a HelperThread , waited for when it goes out of scope : also when the caller's own part throws ,
+// as the task may refer to the caller's locals
+class HelperTask
+{
+public:
+    // `helper` may be null , nothing is started then
+    explicit HelperTask(HelperThread *helper) :helper(helper), started(false) {}
+    ~HelperTask() { wait(); }
+    HelperTask(const HelperTask&) = delete;
+    HelperTask &operator=(const HelperTask&) = delete;
+
+    // false if there is no helper or it is busy , `task` is not started then
+    bool start(std::function<void()> task)
+    {
+        started = helper && helper->start(std::move(task));
+        return started;
+    }
+    void wait()
+    {
+        if (!started) return;
+        started = false;
+        helper->wait();
+    }
+
+private:
+    HelperThread *helper;
+    bool started;
+};
+
+#endif
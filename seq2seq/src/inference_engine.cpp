@@ -0,0 +1,906 @@
+#include "inference_engine.h"
+
+using namespace std;
+
+const unsigned InferenceEngine::MaxBeamWidth;
+
+InferenceEngine::InferenceEngine()
+    :word_embedding_dim(0), enc_h_dim(0), enc_stacked_layer_num(0),
+    dec_h_dim(0), dec_stacked_layer_num(0),
+    enc_hidden_layer_output_dim(0), enc_output_layer_output_dim(0),
+    word_dict_size(0), max_history_len(0), poem_sent_num(0),
+    used_floats(0), aligned_base(nullptr),
+    used_packed_bytes(0), packed_base(nullptr), weight_precision(WeightPrecision::FP32), nr_narrowed_beams(0ULL)
+{}
+
+Eigen::Map<const Eigen::VectorXf> WeightMatrix::row(unsigned r, float *buffer) const
+{
+    switch (precision)
+    {
+    case WeightPrecision::INT8:
+        low_precision::widen_int8(static_cast<const int8_t*>(packed) + static_cast<size_t>(r) * cols, cols, scales[r], buffer);
+        return Eigen::Map<const Eigen::VectorXf>(buffer, cols);
+    case WeightPrecision::FP16:
+        low_precision::widen_fp16(static_cast<const uint16_t*>(packed) + static_cast<size_t>(r) * cols, cols, buffer);
+        return Eigen::Map<const Eigen::VectorXf>(buffer, cols);
+    case WeightPrecision::BF16:
+        low_precision::widen_bf16(static_cast<const uint16_t*>(packed) + static_cast<size_t>(r) * cols, cols, buffer);
+        return Eigen::Map<const Eigen::VectorXf>(buffer, cols);
+    default:
+        return Eigen::Map<const Eigen::VectorXf>(data + static_cast<size_t>(r) * cols, cols);
+    }
+}
+
+void WeightMatrix::copy_row(unsigned r, float *out) const
+{
+    Eigen::Map<const Eigen::VectorXf> values = row(r, out);
+    if (values.data() != out) std::copy(values.data(), values.data() + cols, out);
+}
+
+void WeightMatrix::multiply_add(const Eigen::MatrixXf &X, Eigen::MatrixXf &Y) const
+{
+    switch (precision)
+    {
+    case WeightPrecision::INT8:
+        low_precision::int8_multiply_add(static_cast<const int8_t*>(packed), scales, rows, cols, X, Y);
+        break;
+    case WeightPrecision::FP16:
+        low_precision::fp16_multiply_add(static_cast<const uint16_t*>(packed), rows, cols, X, Y);
+        break;
+    case WeightPrecision::BF16:
+        low_precision::bf16_multiply_add(static_cast<const uint16_t*>(packed), rows, cols, X, Y);
+        break;
+    default:
+        Y.noalias() += mat() * X;
+    }
+}
+
+size_t WeightMatrix::bytes() const
+{
+    size_t nr_values = static_cast<size_t>(rows) * cols;
+    switch (precision)
+    {
+    case WeightPrecision::INT8: return nr_values + rows * sizeof(float);
+    default: return nr_values * weight_precision_bytes(precision);
+    }
+}
+
+void InferenceEngine::reset_storage(size_t nr_floats, size_t nr_blocks)
+{
+    // every block starts at a 64 bytes boundary
+    vector<float> tmp_storage(nr_floats + (nr_blocks + 1U) * BlockAlignFloats, 0.f);
+    swap(storage, tmp_storage);
+    size_t misalign = reinterpret_cast<size_t>(storage.data()) % (BlockAlignFloats * sizeof(float));
+    aligned_base = storage.data() + (misalign == 0U ? 0U : (BlockAlignFloats * sizeof(float) - misalign) / sizeof(float));
+    used_floats = 0U;
+    vector<char>().swap(packed_storage);
+    packed_base = nullptr;
+    used_packed_bytes = 0U;
+    weight_precision = WeightPrecision::FP32;
+}
+
+float *InferenceEngine::alloc_floats(size_t nr_floats)
+{
+    assert(aligned_base + used_floats + nr_floats <= storage.data() + storage.size());
+    float *block = aligned_base + used_floats;
+    used_floats += (nr_floats + BlockAlignFloats - 1U) / BlockAlignFloats * BlockAlignFloats;
+    return block;
+}
+
+void InferenceEngine::reset_packed_storage(size_t nr_bytes, size_t nr_blocks)
+{
+    const size_t align_bytes = BlockAlignFloats * sizeof(float);
+    vector<char> tmp_storage(nr_bytes + (nr_blocks + 1U) * align_bytes, 0);
+    swap(packed_storage, tmp_storage);
+    size_t misalign = reinterpret_cast<size_t>(packed_storage.data()) % align_bytes;
+    packed_base = packed_storage.data() + (misalign == 0U ? 0U : align_bytes - misalign);
+    used_packed_bytes = 0U;
+}
+
+char *InferenceEngine::alloc_packed(size_t nr_bytes)
+{
+    const size_t align_bytes = BlockAlignFloats * sizeof(float);
+    assert(packed_base + used_packed_bytes + nr_bytes <= packed_storage.data() + packed_storage.size());
+    char *block = packed_base + used_packed_bytes;
+    used_packed_bytes += (nr_bytes + align_bytes - 1U) / align_bytes * align_bytes;
+    return block;
+}
+
+void InferenceEngine::collect_weights(vector<pair<string, WeightMatrix*>> &weights)
+{
+    vector<pair<string, WeightMatrix*>> tmp_weights;
+    tmp_weights.push_back(make_pair("words_lookup", &words_lookup));
+    for (RNNWeights *rnn : { &enc_l2r, &enc_r2l, &dec })
+    {
+        string group = rnn == &dec ? "decoder" : "encoder";
+        for (vector<WeightMatrix> *params : { &rnn->x2h, &rnn->h2h, &rnn->hb })
+        {
+            for (WeightMatrix &param : *params) tmp_weights.push_back(make_pair(group, &param));
+        }
+    }
+    for (WeightMatrix *param : { &enc_SOS, &enc_EOS, &enc_hidden_w, &enc_hidden_b,
+        &enc_output_w[0], &enc_output_w[1], &enc_output_w[2], &enc_output_b })
+    {
+        tmp_weights.push_back(make_pair("encoder", param));
+    }
+    tmp_weights.push_back(make_pair("decoder", &dec_SOS));
+    tmp_weights.push_back(make_pair("dec_output", &dec_output_w));
+    tmp_weights.push_back(make_pair("dec_output", &dec_output_b));
+    swap(weights, tmp_weights);
+}
+
+void InferenceEngine::convert_weights(const WeightConversion &conversion)
+{
+    assert(is_loaded() && WeightPrecision::FP32 == weight_precision);
+    if (WeightPrecision::FP32 == conversion.precision) return;
+    // matrices are converted , vectors (biases , SOS / EOS) stay in float .
+    // INT8 keeps the embedding in float : it is only read one row per step
+    vector<pair<string, WeightMatrix*>> weights;
+    collect_weights(weights);
+    auto is_converted = [&conversion](const pair<string, WeightMatrix*> &weight)
+    {
+        return weight.second->cols > 1U
+            && (weight.first != "words_lookup" || conversion.precision != WeightPrecision::INT8);
+    };
+    size_t nr_floats = 0U,
+        nr_bytes = 0U;
+    for (const pair<string, WeightMatrix*> &weight : weights)
+    {
+        size_t nr_values = static_cast<size_t>(weight.second->rows) * weight.second->cols;
+        if (is_converted(weight))
+        {
+            nr_bytes += nr_values * weight_precision_bytes(conversion.precision);
+            if (WeightPrecision::INT8 == conversion.precision) nr_floats += weight.second->rows; // scales
+        }
+        else nr_floats += nr_values;
+    }
+    // the float views point into the old storage until everything is copied
+    vector<float> old_storage;
+    swap(old_storage, storage);
+    reset_storage(nr_floats, weights.size());
+    reset_packed_storage(nr_bytes, weights.size());
+    for (const pair<string, WeightMatrix*> &weight : weights)
+    {
+        WeightMatrix &param = *weight.second;
+        size_t nr_values = static_cast<size_t>(param.rows) * param.cols;
+        if (!is_converted(weight))
+        {
+            float *dst = alloc_floats(nr_values);
+            std::copy(param.data, param.data + nr_values, dst);
+            param.data = dst;
+            continue;
+        }
+        char *dst = alloc_packed(nr_values * weight_precision_bytes(conversion.precision));
+        param.scales = nullptr;
+        if (WeightPrecision::INT8 == conversion.precision)
+        {
+            float *scales = alloc_floats(param.rows);
+            float clip_ratio = conversion.clip_ratio(weight.first);
+            for (unsigned r = 0; r < param.rows; ++r)
+            {
+                scales[r] = low_precision::quantize_row_int8(param.data + static_cast<size_t>(r) * param.cols, param.cols,
+                    clip_ratio, reinterpret_cast<int8_t*>(dst) + static_cast<size_t>(r) * param.cols);
+            }
+            param.scales = scales;
+        }
+        else if (WeightPrecision::FP16 == conversion.precision)
+        {
+            low_precision::narrow_fp16(param.data, nr_values, reinterpret_cast<uint16_t*>(dst));
+        }
+        else low_precision::narrow_bf16(param.data, nr_values, reinterpret_cast<uint16_t*>(dst));
+        param.data = nullptr;
+        param.packed = dst;
+        param.precision = conversion.precision;
+    }
+    weight_precision = conversion.precision;
+    mapped_model.reset(); // the float weights left are copies now
+    greedy_kernels.clear(); // compiled kernels read fp32 weights
+    // tables and states computed with the float weights are dropped
+    for (RNNWeights *rnn : { &enc_l2r, &enc_r2l, &dec })
+    {
+        rnn->input_projection.resize(0, 0);
+        rnn->start_projection.resize(0);
+    }
+    if (encoder_cache) enable_encoder_cache(encoder_cache->capacity());
+    BOOST_LOG_TRIVIAL(info) << "native inference engine weights converted to " << weight_precision_name(weight_precision)
+        << " , " << storage_bytes() / (1 << 20) << " MB";
+}
+
+void InferenceEngine::copy_param(const cnn::Parameters *p, WeightMatrix &out)
+{
+    // cnn stores tensors column-major ; transpose to row-major
+    const cnn::Tensor &t = p->values;
+    unsigned rows = t.d.rows(),
+        cols = t.d.size() / rows;
+    if (bind_mapped_param(p, rows, cols, out)) return;
+    float *dst = alloc_floats(rows * cols);
+    for (unsigned r = 0; r < rows; ++r)
+    {
+        for (unsigned c = 0; c < cols; ++c) dst[r * cols + c] = t.v[c * rows + r];
+    }
+    out = WeightMatrix();
+    out.data = dst;
+    out.rows = rows;
+    out.cols = cols;
+}
+
+void InferenceEngine::copy_lookup_param(const cnn::LookupParameters *lp, WeightMatrix &out)
+{
+    unsigned rows = lp->values.size(),
+        cols = lp->values.empty() ? 0U : lp->values[0].d.size();
+    if (bind_mapped_param(lp, rows, cols, out)) return;
+    float *dst = alloc_floats(rows * cols);
+    for (unsigned r = 0; r < rows; ++r)
+    {
+        std::copy(lp->values[r].v, lp->values[r].v + cols, dst + r * cols);
+    }
+    out = WeightMatrix();
+    out.data = dst;
+    out.rows = rows;
+    out.cols = cols;
+}
+
+bool InferenceEngine::bind_mapped_param(const void *p, unsigned rows, unsigned cols, WeightMatrix &out)
+{
+    auto mapped_param = mapped_params.find(p);
+    if (mapped_param == mapped_params.end()) return false;
+    bind_mapped_block(*mapped_param->second, rows, cols, out);
+    return true;
+}
+
+void InferenceEngine::bind_mapped_block(const ModelFileParam &block, unsigned rows, unsigned cols, WeightMatrix &out)
+{
+    // the mapped blocks are already row-major and aligned
+    if (block.rows != rows || block.cols != cols)
+    {
+        throw runtime_error("binary model parameter of {" + to_string(block.rows) + " , " + to_string(block.cols)
+            + "} , expected {" + to_string(rows) + " , " + to_string(cols) + "}");
+    }
+    out = WeightMatrix();
+    out.data = mapped_model->values(block);
+    out.rows = rows;
+    out.cols = cols;
+}
+
+void InferenceEngine::load_from(shared_ptr<const MappedModelFile> mapped)
+{
+    const ModelFileHeader &header = mapped->header();
+    if (header.rnn_type != static_cast<uint32_t>(ModelFileRNNType::SimpleRNN))
+    {
+        throw runtime_error("native inference engine only supports SimpleRNN models");
+    }
+    word_embedding_dim = header.word_embedding_dim;
+    enc_h_dim = header.enc_h_dim;
+    enc_stacked_layer_num = header.enc_stacked_layer_num;
+    dec_h_dim = header.dec_h_dim;
+    dec_stacked_layer_num = header.dec_stacked_layer_num;
+    enc_hidden_layer_output_dim = header.enc_hidden_layer_output_dim;
+    enc_output_layer_output_dim = header.enc_output_layer_output_dim;
+    word_dict_size = header.word_dict_size;
+    max_history_len = PoemGenerator<cnn::SimpleRNNBuilder>::MaxHistoryLen;
+    poem_sent_num = PoemGenerator<cnn::SimpleRNNBuilder>::PoemSentNum;
+    greedy_kernels.clear(); // bound to the dimensions of the model before
+
+    // the parameters in `PoemGenerator::build_model` order , see `load_from(pg)`
+    size_t enc_rnn_param_num = 3U * enc_stacked_layer_num,
+        dec_rnn_param_num = 3U * dec_stacked_layer_num;
+    if (header.nr_params != 2U * enc_rnn_param_num + 2U + dec_rnn_param_num + 9U || header.nr_lookup_params != 1U)
+    {
+        throw runtime_error("binary model doesn't match the model parameters");
+    }
+    mapped_model = mapped;
+    mapped_params.clear();
+    reset_storage(0U, 0U);
+    size_t param_idx = 0U;
+    auto bind_next = [&](unsigned rows, unsigned cols, WeightMatrix &out) { bind_mapped_block(mapped->param(param_idx++), rows, cols, out); };
+    auto bind_rnn = [&](unsigned input_dim, unsigned h_dim, unsigned layers, RNNWeights &out)
+    {
+        RNNWeights tmp_out;
+        tmp_out.x2h.resize(layers);
+        tmp_out.h2h.resize(layers);
+        tmp_out.hb.resize(layers);
+        for (unsigned layer_idx = 0; layer_idx < layers; ++layer_idx)
+        {
+            bind_next(h_dim, layer_idx == 0U ? input_dim : h_dim, tmp_out.x2h[layer_idx]);
+            bind_next(h_dim, h_dim, tmp_out.h2h[layer_idx]);
+            bind_next(h_dim, 1U, tmp_out.hb[layer_idx]);
+        }
+        swap(out, tmp_out);
+    };
+    bind_rnn(word_embedding_dim, enc_h_dim, enc_stacked_layer_num, enc_l2r);
+    bind_rnn(word_embedding_dim, enc_h_dim, enc_stacked_layer_num, enc_r2l);
+    bind_next(word_embedding_dim, 1U, enc_SOS);
+    bind_next(word_embedding_dim, 1U, enc_EOS);
+    bind_rnn(word_embedding_dim, dec_h_dim, dec_stacked_layer_num, dec);
+    bind_next(enc_hidden_layer_output_dim, enc_h_dim * enc_stacked_layer_num * 2U, enc_hidden_w);
+    bind_next(enc_hidden_layer_output_dim, 1U, enc_hidden_b);
+    for (WeightMatrix &w : enc_output_w) bind_next(enc_output_layer_output_dim, enc_hidden_layer_output_dim, w);
+    bind_next(enc_output_layer_output_dim, 1U, enc_output_b);
+    bind_next(word_dict_size, dec_h_dim, dec_output_w);
+    bind_next(word_dict_size, 1U, dec_output_b);
+    bind_next(word_embedding_dim, 1U, dec_SOS);
+    bind_mapped_block(mapped->lookup_param(0U), word_dict_size, word_embedding_dim, words_lookup);
+    BOOST_LOG_TRIVIAL(info) << "native inference engine ready without a cnn model , mapped " << mapped_bytes() / (1 << 20) << " MB";
+}
+
+void InferenceEngine::weight_bytes_by_group(map<string, GroupBytes> &groups)
+{
+    map<string, GroupBytes> tmp_groups;
+    vector<pair<string, WeightMatrix*>> weights;
+    collect_weights(weights);
+    for (const pair<string, WeightMatrix*> &weight : weights)
+    {
+        GroupBytes &group = tmp_groups[weight.first];
+        if (mapped_model && mapped_model->contains(weight.second->data)) group.mapped += weight.second->bytes();
+        else group.owned += weight.second->bytes();
+    }
+    size_t nr_table_floats = enc_l2r.input_projection.size() + enc_r2l.input_projection.size() + dec.input_projection.size();
+    if (nr_table_floats > 0U) tmp_groups["projection_tables"].owned = nr_table_floats * sizeof(float);
+    swap(groups, tmp_groups);
+}
+
+void InferenceEngine::copy_rnn_params(const vector<cnn::Parameters*> &params_list, size_t offset, unsigned layers, RNNWeights &out)
+{
+    RNNWeights tmp_out;
+    tmp_out.x2h.resize(layers);
+    tmp_out.h2h.resize(layers);
+    tmp_out.hb.resize(layers);
+    for (unsigned layer_idx = 0; layer_idx < layers; ++layer_idx)
+    {
+        copy_param(params_list.at(offset + layer_idx * 3U), tmp_out.x2h[layer_idx]);
+        copy_param(params_list.at(offset + layer_idx * 3U + 1U), tmp_out.h2h[layer_idx]);
+        copy_param(params_list.at(offset + layer_idx * 3U + 2U), tmp_out.hb[layer_idx]);
+    }
+    swap(out, tmp_out);
+}
+
+void InferenceEngine::first_layer_input(const RNNWeights &rnn, const WeightMatrix &start, const IndexSeq &words, Eigen::MatrixXf &Y) const
+{
+    if (rnn.input_projection.size() > 0)
+    {
+        Y.resize(rnn.input_projection.cols(), words.size());
+        for (size_t idx = 0; idx < words.size(); ++idx)
+        {
+            if (-1 == words[idx]) Y.col(idx) = rnn.start_projection;
+            else Y.col(idx) = rnn.input_projection.row(words[idx]).transpose();
+        }
+        return;
+    }
+    Eigen::MatrixXf X(word_embedding_dim, words.size());
+    for (size_t idx = 0; idx < words.size(); ++idx)
+    {
+        if (-1 == words[idx]) X.col(idx) = start.vec();
+        else words_lookup.copy_row(words[idx], X.col(idx).data());
+    }
+    Y = rnn.hb[0].vec().replicate(1, words.size());
+    rnn.x2h[0].multiply_add(X, Y);
+}
+
+void InferenceEngine::rnn_step(const RNNWeights &rnn, const Eigen::MatrixXf &first_input, vector<Eigen::MatrixXf> &H)
+{
+    // H is zero at the start of sequence , which is the same as having no recurrent input
+    for (size_t layer_idx = 0; layer_idx < H.size(); ++layer_idx)
+    {
+        Eigen::MatrixXf Y;
+        if (0 == layer_idx) Y = first_input;
+        else
+        {
+            Y = rnn.hb[layer_idx].vec().replicate(1, first_input.cols());
+            rnn.x2h[layer_idx].multiply_add(H[layer_idx - 1], Y);
+        }
+        rnn.h2h[layer_idx].multiply_add(H[layer_idx], Y);
+        H[layer_idx] = Y.array().tanh();
+    }
+}
+
+void InferenceEngine::build_projection_table(const WeightMatrix &start, RNNWeights &rnn)
+{
+    // in chunks of words , so the embedding block stays small
+    const unsigned ChunkWords = 1024U;
+    unsigned h_dim = rnn.x2h[0].rows;
+    rnn.input_projection.resize(word_dict_size, h_dim);
+    Eigen::MatrixXf X, Y;
+    for (unsigned word_begin = 0; word_begin < word_dict_size; word_begin += ChunkWords)
+    {
+        unsigned chunk_words = std::min(ChunkWords, word_dict_size - word_begin);
+        X.resize(word_embedding_dim, chunk_words);
+        for (unsigned idx = 0; idx < chunk_words; ++idx) words_lookup.copy_row(word_begin + idx, X.col(idx).data());
+        Y = rnn.hb[0].vec().replicate(1, chunk_words);
+        rnn.x2h[0].multiply_add(X, Y);
+        rnn.input_projection.middleRows(word_begin, chunk_words) = Y.transpose();
+    }
+    Y = rnn.hb[0].vec();
+    rnn.x2h[0].multiply_add(start.vec(), Y);
+    rnn.start_projection = Y;
+}
+
+void InferenceEngine::build_projection_tables()
+{
+    assert(is_loaded());
+    build_projection_table(enc_SOS, enc_l2r);
+    build_projection_table(enc_EOS, enc_r2l);
+    build_projection_table(dec_SOS, dec);
+    size_t table_bytes = (enc_l2r.input_projection.size() + enc_r2l.input_projection.size() + dec.input_projection.size()) * sizeof(float);
+    BOOST_LOG_TRIVIAL(info) << "input projection tables built , " << table_bytes / (1 << 20) << " MB";
+}
+
+void InferenceEngine::select_columns(const vector<unsigned> &cols, Eigen::MatrixXf &M)
+{
+    Eigen::MatrixXf tmp_M(M.rows(), cols.size());
+    for (size_t idx = 0; idx < cols.size(); ++idx) tmp_M.col(idx) = M.col(cols[idx]);
+    M.swap(tmp_M);
+}
+
+void InferenceEngine::lookup(const IndexSeq &words, Eigen::MatrixXf &X) const
+{
+    X.resize(word_embedding_dim, words.size());
+    for (size_t idx = 0; idx < words.size(); ++idx) words_lookup.copy_row(words[idx], X.col(idx).data());
+}
+
+void InferenceEngine::encode_direction(const RNNWeights &rnn, const WeightMatrix &start, const vector<IndexSeq> &seqs,
+    bool reverse, vector<Eigen::MatrixXf> &H) const
+{
+    size_t batch_size = seqs.size(),
+        seq_len = seqs.empty() ? 0U : seqs[0].size();
+    H.assign(enc_stacked_layer_num, Eigen::MatrixXf::Zero(enc_h_dim, batch_size));
+    IndexSeq words(batch_size, -1);
+    Eigen::MatrixXf X;
+    first_layer_input(rnn, start, words, X);
+    rnn_step(rnn, X, H);
+    for (size_t pos = 0; pos < seq_len; ++pos)
+    {
+        for (size_t seq_idx = 0; seq_idx < batch_size; ++seq_idx)
+        {
+            words[seq_idx] = seqs[seq_idx].at(reverse ? seq_len - pos - 1 : pos);
+        }
+        first_layer_input(rnn, start, words, X);
+        rnn_step(rnn, X, H);
+    }
+}
+
+void InferenceEngine::encode(const vector<IndexSeq> &seqs, Eigen::MatrixXf &enc_hidden_output) const
+{
+    // every sequence in the batch has the same length
+    size_t batch_size = seqs.size();
+    vector<Eigen::MatrixXf> l2r_h,
+        r2l_h;
+    // the directions are independent until their final states are combined
+    HelperTask r2l_task(encoder_helper.get());
+    if (r2l_task.start([&]{ encode_direction(enc_r2l, enc_EOS, seqs, true, r2l_h); }))
+    {
+        encode_direction(enc_l2r, enc_SOS, seqs, false, l2r_h);
+        r2l_task.wait();
+    }
+    else
+    {
+        encode_direction(enc_l2r, enc_SOS, seqs, false, l2r_h);
+        encode_direction(enc_r2l, enc_EOS, seqs, true, r2l_h);
+    }
+    // same order as `BIRNNLayer::get_final_h` : l2r layers , then r2l layers
+    Eigen::MatrixXf h_combined(enc_h_dim * enc_stacked_layer_num * 2U, batch_size);
+    for (unsigned layer_idx = 0; layer_idx < enc_stacked_layer_num; ++layer_idx)
+    {
+        h_combined.middleRows(layer_idx * enc_h_dim, enc_h_dim) = l2r_h[layer_idx];
+        h_combined.middleRows((enc_stacked_layer_num + layer_idx) * enc_h_dim, enc_h_dim) = r2l_h[layer_idx];
+    }
+    Eigen::MatrixXf tmp_output = enc_hidden_b.vec().replicate(1, batch_size);
+    enc_hidden_w.multiply_add(h_combined, tmp_output);
+    enc_hidden_output = tmp_output.cwiseMax(0.f); // rectify
+}
+
+void InferenceEngine::init_decoder(const deque<Eigen::MatrixXf> &history, vector<Eigen::MatrixXf> &dec_h) const
+{
+    assert(!history.empty() && history.size() <= 3U);
+    Eigen::MatrixXf enc_output = enc_output_b.vec().replicate(1, history[0].cols());
+    for (size_t history_idx = 0; history_idx < history.size(); ++history_idx)
+    {
+        enc_output_w[history_idx].multiply_add(history[history_idx], enc_output);
+    }
+    vector<Eigen::MatrixXf> tmp_dec_h(dec_stacked_layer_num);
+    for (unsigned layer_idx = 0; layer_idx < dec_stacked_layer_num; ++layer_idx)
+    {
+        tmp_dec_h[layer_idx] = enc_output.middleRows(layer_idx * dec_h_dim, dec_h_dim).array().tanh();
+    }
+    swap(dec_h, tmp_dec_h);
+}
+
+void InferenceEngine::decode_step(const IndexSeq &pre_words, vector<Eigen::MatrixXf> &dec_h, Eigen::MatrixXf &dist,
+    const OutputShortlist *shortlist) const
+{
+    Eigen::MatrixXf first_input;
+    first_layer_input(dec, dec_SOS, pre_words, first_input);
+    rnn_step(dec, first_input, dec_h);
+    if (shortlist)
+    {
+        dist = shortlist->b.replicate(1, pre_words.size());
+        dist.noalias() += shortlist->w * dec_h.back();
+        return;
+    }
+    dist = dec_output_b.vec().replicate(1, pre_words.size());
+    dec_output_w.multiply_add(dec_h.back(), dist);
+}
+
+void InferenceEngine::enable_encoder_cache(size_t capacity)
+{
+    if (0U == capacity) encoder_cache.reset();
+    else encoder_cache = make_shared<EncoderStateCache>(capacity);
+}
+
+void InferenceEngine::set_poem_sent_num(size_t sent_num)
+{
+    assert(sent_num >= 2U);
+    if (sent_num != poem_sent_num) greedy_kernels.clear();
+    poem_sent_num = sent_num;
+}
+
+void InferenceEngine::set_greedy_kernel(size_t sent_len, shared_ptr<const GreedyKernel> kernel)
+{
+    if (kernel) greedy_kernels[sent_len] = kernel;
+    else greedy_kernels.erase(sent_len);
+}
+
+void InferenceEngine::enable_parallel_encoder(bool enabled)
+{
+    if (!enabled) encoder_helper.reset();
+    else if (!encoder_helper) encoder_helper.reset(new HelperThread());
+}
+
+void InferenceEngine::set_vocab_shortlist(shared_ptr<const VocabShortlist> shortlist)
+{
+    if (shortlist && shortlist->get_word_dict_size() != word_dict_size)
+    {
+        throw runtime_error("vocabulary shortlist was built for another word dict");
+    }
+    vocab_shortlist = shortlist;
+}
+
+bool InferenceEngine::make_output_shortlist(const IndexSeq &first_seq, unsigned beam_width, OutputShortlist &shortlist) const
+{
+    if (!vocab_shortlist) return false;
+    IndexSeq words;
+    vocab_shortlist->candidates(first_seq, words);
+    // every hypothesis must still have `beam_width` unused candidates at its last character
+    size_t min_words = (poem_sent_num - 1U) * first_seq.size() + beam_width;
+    if (words.size() < min_words || words.size() * 2U > word_dict_size) return false;
+    // gather the rows once , the decoder steps of the request then run over the small matrix
+    shortlist.w.resize(words.size(), dec_h_dim);
+    shortlist.b.resize(words.size());
+    for (size_t row_idx = 0; row_idx < words.size(); ++row_idx)
+    {
+        dec_output_w.copy_row(words[row_idx], shortlist.w.row(row_idx).data()); // rows of `w` are contiguous
+        shortlist.b(row_idx) = dec_output_b.data[words[row_idx]];
+    }
+    swap(shortlist.words, words);
+    return true;
+}
+
+void InferenceEngine::prepare_decoder(const vector<IndexSeq> &cur_seqs, size_t generating_idx,
+    deque<Eigen::MatrixXf> &history, vector<Eigen::MatrixXf> &dec_h) const
+{
+    if (1U == generating_idx && encoder_cache)
+    {
+        // look up every first line , encode the missed ones as one batch
+        size_t batch_size = cur_seqs.size();
+        vector<shared_ptr<const EncoderState>> states(batch_size);
+        vector<IndexSeq> miss_seqs;
+        vector<size_t> miss_pos;
+        for (size_t seq_idx = 0; seq_idx < batch_size; ++seq_idx)
+        {
+            states[seq_idx] = encoder_cache->get(cur_seqs[seq_idx]);
+            if (!states[seq_idx])
+            {
+                miss_seqs.push_back(cur_seqs[seq_idx]);
+                miss_pos.push_back(seq_idx);
+            }
+        }
+        if (!miss_seqs.empty())
+        {
+            Eigen::MatrixXf miss_enc_hidden_output;
+            vector<Eigen::MatrixXf> miss_dec_h;
+            encode(miss_seqs, miss_enc_hidden_output);
+            init_decoder(deque<Eigen::MatrixXf>(1, miss_enc_hidden_output), miss_dec_h);
+            for (size_t miss_idx = 0; miss_idx < miss_seqs.size(); ++miss_idx)
+            {
+                shared_ptr<EncoderState> new_state = make_shared<EncoderState>();
+                new_state->enc_hidden_output = miss_enc_hidden_output.col(miss_idx);
+                for (const Eigen::MatrixXf &h : miss_dec_h) new_state->dec_init_h.push_back(h.col(miss_idx));
+                encoder_cache->put(miss_seqs[miss_idx], new_state);
+                states[miss_pos[miss_idx]] = new_state;
+            }
+        }
+        history.assign(1, Eigen::MatrixXf(enc_hidden_layer_output_dim, batch_size));
+        dec_h.assign(dec_stacked_layer_num, Eigen::MatrixXf(dec_h_dim, batch_size));
+        for (size_t seq_idx = 0; seq_idx < batch_size; ++seq_idx)
+        {
+            history[0].col(seq_idx) = states[seq_idx]->enc_hidden_output;
+            for (unsigned layer_idx = 0; layer_idx < dec_stacked_layer_num; ++layer_idx)
+            {
+                dec_h[layer_idx].col(seq_idx) = states[seq_idx]->dec_init_h[layer_idx];
+            }
+        }
+        return;
+    }
+    Eigen::MatrixXf enc_hidden_output;
+    encode(cur_seqs, enc_hidden_output);
+    history.push_front(enc_hidden_output);
+    if (history.size() > max_history_len) history.resize(max_history_len);
+    init_decoder(history, dec_h);
+}
+
+bool InferenceEngine::generate(const IndexSeq &first_seq, Poem &generated_poem, const DecodeOptions &opts) const
+{
+    vector<ScoredPoem> generated_poems;
+    bool is_narrowed = generate_n_best(first_seq, 1U, generated_poems, opts);
+    swap(generated_poems.at(0).poem, generated_poem);
+    return is_narrowed;
+}
+
+bool InferenceEngine::generate_n_best(const IndexSeq &first_seq, size_t n, vector<ScoredPoem> &generated_poems,
+    const DecodeOptions &opts) const
+{
+    // greedy decoding has one result , several ones come from a beam at least `n` wide
+    size_t nr_poems = std::max<size_t>(std::min<size_t>(n, MaxBeamWidth), 1U);
+    unsigned beam_width = std::max(std::min(opts.beam_width, MaxBeamWidth), 1U);
+    if (!opts.is_sampling()) beam_width = std::max(beam_width, static_cast<unsigned>(nr_poems));
+    OutputShortlist shortlist;
+    const OutputShortlist *p_shortlist = nullptr;
+    if (opts.use_shortlist && make_output_shortlist(first_seq, beam_width, shortlist)) p_shortlist = &shortlist;
+    // one poem goes back without its score , the normalizer of every step is skipped then
+    bool need_log_prob = nr_poems > 1U;
+    if (opts.is_sampling()) sample_batch(first_seq, nr_poems, opts.sampling, opts.seed, generated_poems, p_shortlist, need_log_prob);
+    else if (beam_width > 1U)
+    {
+        bool is_narrowed = beam_search(first_seq, beam_width, generated_poems, p_shortlist, opts.deadline);
+        if (generated_poems.size() > nr_poems) generated_poems.resize(nr_poems);
+        return is_narrowed;
+    }
+    else greedy_search(first_seq, generated_poems, p_shortlist, need_log_prob);
+    return false;
+}
+
+void InferenceEngine::greedy_search(const IndexSeq &first_seq, Poem &generated_poem, const OutputShortlist *shortlist) const
+{
+    vector<ScoredPoem> generated_poems;
+    greedy_search(first_seq, generated_poems, shortlist, false);
+    swap(generated_poems.at(0).poem, generated_poem);
+}
+
+void InferenceEngine::greedy_search(const IndexSeq &first_seq, vector<ScoredPoem> &generated_poems,
+    const OutputShortlist *shortlist, bool need_log_prob) const
+{
+    auto kernel_ite = greedy_kernels.find(first_seq.size());
+    if (kernel_ite != greedy_kernels.end() && !shortlist)
+    {
+        generated_poems.assign(1U, ScoredPoem());
+        kernel_ite->second->generate(first_seq, generated_poems[0], need_log_prob);
+        return;
+    }
+    // zero temperature takes the best word
+    sample_batch(first_seq, 1U, SamplingParams(), 0U, generated_poems, shortlist, need_log_prob);
+}
+
+void InferenceEngine::sample_batch(const IndexSeq &first_seq, size_t nr_samples, const SamplingParams &params,
+    unsigned long long seed, vector<ScoredPoem> &generated_poems, const OutputShortlist *shortlist, bool need_log_prob) const
+{
+    // samples are columns of the state matrices , the first line is encoded once and shared by all of them .
+    // sample `i` draws from its own RNG seeded with `seed + i` .
+    // with a shortlist , scores and bitmaps are over shortlist rows , mapped back to words when chosen
+    size_t poem_sent_len = first_seq.size(),
+        nr_rows = shortlist ? shortlist->words.size() : word_dict_size;
+    need_log_prob = need_log_prob || nr_samples > 1U;
+    vector<ScoredPoem> tmp_poems(nr_samples);
+    vector<ExclusionBitmap> generated_bitmaps(nr_samples, ExclusionBitmap(nr_rows));
+    vector<mt19937_64> rngs;
+    for (size_t sample_idx = 0; sample_idx < nr_samples; ++sample_idx)
+    {
+        tmp_poems[sample_idx].poem.assign(poem_sent_num, IndexSeq(poem_sent_len));
+        tmp_poems[sample_idx].poem[0] = first_seq;
+        tmp_poems[sample_idx].log_prob = need_log_prob ? 0.f : numeric_limits<float>::quiet_NaN();
+        rngs.push_back(mt19937_64(seed + sample_idx));
+    }
+    vector<ScoredIndex> sample_buf(MaxSampleCandidates);
+    deque<Eigen::MatrixXf> history_outputs;
+    vector<Eigen::MatrixXf> dec_h;
+    Eigen::MatrixXf dist;
+    IndexSeq words(nr_samples);
+    for (size_t generating_idx = 1; generating_idx < poem_sent_num; ++generating_idx)
+    {
+        if (1U == generating_idx)
+        {
+            prepare_decoder(vector<IndexSeq>(1, first_seq), generating_idx, history_outputs, dec_h);
+            vector<unsigned> shared_col(nr_samples, 0U);
+            for (Eigen::MatrixXf &h : dec_h) select_columns(shared_col, h);
+            for (Eigen::MatrixXf &history : history_outputs) select_columns(shared_col, history);
+        }
+        else
+        {
+            vector<IndexSeq> cur_seqs;
+            for (const ScoredPoem &sample : tmp_poems) cur_seqs.push_back(sample.poem[generating_idx - 1]);
+            prepare_decoder(cur_seqs, generating_idx, history_outputs, dec_h);
+        }
+
+        words.assign(nr_samples, -1);
+        for (size_t gen_idx = 0; gen_idx < poem_sent_len; ++gen_idx)
+        {
+            decode_step(words, dec_h, dist, shortlist);
+            for (size_t sample_idx = 0; sample_idx < nr_samples; ++sample_idx)
+            {
+                auto col = dist.col(sample_idx);
+                // same rule as the graph path : never repeat a word generated before
+                float log_z;
+                Index predicted_row = masked_sample(col.data(), nr_rows, generated_bitmaps[sample_idx], params,
+                    rngs[sample_idx], sample_buf.data(), need_log_prob ? &log_z : nullptr);
+                assert(predicted_row != -1);
+                generated_bitmaps[sample_idx].set(predicted_row);
+                ScoredPoem &sample = tmp_poems[sample_idx];
+                if (need_log_prob) sample.log_prob += col(predicted_row) - log_z;
+                words[sample_idx] = shortlist ? shortlist->words[predicted_row] : predicted_row;
+                sample.poem[generating_idx][gen_idx] = words[sample_idx];
+            }
+        }
+    }
+    std::stable_sort(tmp_poems.begin(), tmp_poems.end(),
+        [](const ScoredPoem &a, const ScoredPoem &b) { return a.log_prob > b.log_prob; });
+    swap(tmp_poems, generated_poems);
+}
+
+namespace
+{
+struct BeamCandidate
+{
+    float score;
+    unsigned parent;
+    Index word;
+    bool operator>(const BeamCandidate &other) const { return score > other.score; }
+};
+}
+
+bool InferenceEngine::beam_search(const IndexSeq &first_seq, unsigned beam_width, vector<ScoredPoem> &generated_poems,
+    const OutputShortlist *shortlist, chrono::steady_clock::time_point deadline) const
+{
+    // hypotheses are columns of the state matrices , so the whole beam is expanded by one matrix product per step .
+    // the no-repeat rule is kept per hypothesis , scores are accumulated log probabilities .
+    // with a shortlist , the softmax is normalized over the shortlist rows only .
+    size_t poem_sent_len = first_seq.size();
+    vector<Poem> beam_poems(1, Poem(poem_sent_num, IndexSeq(poem_sent_len)));
+    std::copy(first_seq.cbegin(), first_seq.cend(), beam_poems[0][0].begin());
+    vector<ExclusionBitmap> beam_generated_bitmaps(1, ExclusionBitmap(shortlist ? shortlist->words.size() : word_dict_size)),
+        next_beam_generated_bitmaps;
+    vector<float> beam_scores(1, 0.f);
+    deque<Eigen::MatrixXf> history_outputs;
+    vector<Eigen::MatrixXf> dec_h;
+    Eigen::MatrixXf dist;
+    IndexSeq words;
+    vector<BeamCandidate> candidates;
+    vector<ScoredIndex> hyp_top_k(beam_width);
+    bool has_deadline = deadline != chrono::steady_clock::time_point::max(),
+        is_narrowed = false;
+    chrono::steady_clock::time_point line_start = chrono::steady_clock::now();
+    for (size_t generating_idx = 1; generating_idx < poem_sent_num; ++generating_idx)
+    {
+        if (has_deadline && generating_idx > 1U && beam_poems.size() > 1U)
+        {
+            // the cost of a line grows with the hypotheses decoded together
+            chrono::steady_clock::time_point now = chrono::steady_clock::now();
+            double hyp_line_time = chrono::duration<double>(now - line_start).count() / beam_poems.size(),
+                time_left = chrono::duration<double>(deadline - now).count();
+            size_t lines_left = poem_sent_num - generating_idx,
+                affordable_width = time_left <= 0. ? 1U : static_cast<size_t>(time_left / (hyp_line_time * lines_left));
+            if (affordable_width < beam_poems.size())
+            {
+                // the hypotheses are sorted , the best ones are kept
+                size_t narrowed_width = std::max<size_t>(affordable_width, 1U);
+                beam_width = static_cast<unsigned>(narrowed_width);
+                beam_poems.resize(narrowed_width);
+                beam_generated_bitmaps.resize(narrowed_width);
+                beam_scores.resize(narrowed_width);
+                vector<unsigned> kept(narrowed_width);
+                for (size_t beam_idx = 0; beam_idx < narrowed_width; ++beam_idx) kept[beam_idx] = static_cast<unsigned>(beam_idx);
+                for (Eigen::MatrixXf &history : history_outputs) select_columns(kept, history);
+                is_narrowed = true;
+            }
+            line_start = now;
+        }
+        vector<IndexSeq> cur_seqs;
+        for (const Poem &poem : beam_poems) cur_seqs.push_back(poem.at(generating_idx - 1));
+        prepare_decoder(cur_seqs, generating_idx, history_outputs, dec_h);
+
+        words.assign(beam_poems.size(), -1);
+        for (size_t gen_idx = 0; gen_idx < poem_sent_len; ++gen_idx)
+        {
+            decode_step(words, dec_h, dist, shortlist);
+            // keep the top `beam_width` expansions of every hypothesis , then the top of all
+            candidates.clear();
+            for (unsigned hyp_idx = 0; hyp_idx < dist.cols(); ++hyp_idx)
+            {
+                auto col = dist.col(hyp_idx);
+                float log_z;
+                size_t nr_top = masked_top_k(col.data(), col.rows(), beam_generated_bitmaps[hyp_idx], beam_width, hyp_top_k.data(),
+                    &log_z);
+                for (size_t top_idx = 0; top_idx < nr_top; ++top_idx)
+                {
+                    BeamCandidate cand = { beam_scores[hyp_idx] + hyp_top_k[top_idx].score - log_z, hyp_idx, hyp_top_k[top_idx].idx };
+                    candidates.push_back(cand);
+                }
+            }
+            size_t next_beam_size = std::min(candidates.size(), static_cast<size_t>(beam_width));
+            std::partial_sort(candidates.begin(), candidates.begin() + next_beam_size, candidates.end(), std::greater<BeamCandidate>());
+
+            vector<Poem> next_beam_poems(next_beam_size);
+            next_beam_generated_bitmaps.resize(next_beam_size);
+            vector<float> next_beam_scores(next_beam_size);
+            vector<unsigned> parents(next_beam_size);
+            words.resize(next_beam_size);
+            for (size_t beam_idx = 0; beam_idx < next_beam_size; ++beam_idx)
+            {
+                const BeamCandidate &cand = candidates[beam_idx];
+                Index word = shortlist ? shortlist->words[cand.word] : cand.word;
+                next_beam_poems[beam_idx] = beam_poems[cand.parent];
+                next_beam_poems[beam_idx][generating_idx][gen_idx] = word;
+                next_beam_generated_bitmaps[beam_idx] = beam_generated_bitmaps[cand.parent];
+                next_beam_generated_bitmaps[beam_idx].set(cand.word);
+                next_beam_scores[beam_idx] = cand.score;
+                parents[beam_idx] = cand.parent;
+                words[beam_idx] = word;
+            }
+            swap(beam_poems, next_beam_poems);
+            swap(beam_generated_bitmaps, next_beam_generated_bitmaps);
+            swap(beam_scores, next_beam_scores);
+            for (Eigen::MatrixXf &h : dec_h) select_columns(parents, h);
+            for (Eigen::MatrixXf &history : history_outputs) select_columns(parents, history);
+        }
+    }
+    if (is_narrowed) ++nr_narrowed_beams;
+    // candidates are sorted , so the hypotheses are from the best
+    vector<ScoredPoem> tmp_poems(beam_poems.size());
+    for (size_t beam_idx = 0; beam_idx < beam_poems.size(); ++beam_idx)
+    {
+        swap(tmp_poems[beam_idx].poem, beam_poems[beam_idx]);
+        tmp_poems[beam_idx].log_prob = beam_scores[beam_idx];
+    }
+    swap(tmp_poems, generated_poems);
+    return is_narrowed;
+}
+
+void InferenceEngine::teacher_forced_logits(const Poem &poem, Eigen::MatrixXf &logits) const
+{
+    // the same state path as decoding the given lines
+    size_t nr_steps = 0U;
+    for (size_t generating_idx = 1; generating_idx < poem.size(); ++generating_idx) nr_steps += poem[generating_idx].size();
+    logits.resize(word_dict_size, nr_steps);
+    size_t step_idx = 0U;
+    deque<Eigen::MatrixXf> history_outputs;
+    vector<Eigen::MatrixXf> dec_h;
+    Eigen::MatrixXf dist;
+    IndexSeq pre_word(1);
+    for (size_t generating_idx = 1; generating_idx < poem.size(); ++generating_idx)
+    {
+        prepare_decoder(vector<IndexSeq>(1, poem.at(generating_idx - 1)), generating_idx, history_outputs, dec_h);
+        pre_word[0] = -1;
+        for (Index word : poem.at(generating_idx))
+        {
+            decode_step(pre_word, dec_h, dist);
+            logits.col(step_idx++) = dist;
+            pre_word[0] = word;
+        }
+    }
+}
+
+float InferenceEngine::log_prob(const Poem &poem) const
+{
+    Eigen::MatrixXf logits;
+    teacher_forced_logits(poem, logits);
+    float sum_log_prob = 0.f;
+    size_t step_idx = 0U;
+    for (size_t generating_idx = 1; generating_idx < poem.size(); ++generating_idx)
+    {
+        for (Index word : poem[generating_idx])
+        {
+            auto col = logits.col(step_idx++);
+            float max_score = col.maxCoeff(),
+                log_z = max_score + std::log((col.array() - max_score).exp().sum());
+            sum_log_prob += col(word) - log_z;
+        }
+    }
+    return sum_log_prob;
+}
@@ -0,0 +1,350 @@
+#ifndef INFERENCE_ENGINE_H_INCLUDED
+#define INFERENCE_ENGINE_H_INCLUDED
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+#include <stdexcept>
+#include <limits>
+#include <atomic>
+#include <chrono>
+#include <Eigen/Dense>
+#include <boost/log/trivial.hpp>
+
+#include "cnn/cnn.h"
+#include "cnn/rnn.h"
+
+#include "poem_generate.h"
+#include "encoder_cache.h"
+#include "helper_thread.h"
+#include "low_precision.h"
+#include "model_file.h"
+#include "selection.h"
+#include "shortlist.h"
+#include "typedec.h"
+
+/*
+ * Graph-free inference engine .
+ * weights of a trained PoemGenerator are copied once into one flat contiguous storage ,
+ * and the SimpleRNN recurrences and dense layers are evaluated directly with Eigen .
+ * It produces the same poems as `PoemGenerator::generate` without building any ComputationGraph .
+ */
+
+// row-major view into the weight storage . vectors are {rows , 1}
+// low precision values live in `packed` (INT8 with per-row `scales` , FP16 , BF16) ; `mat` and `vec` are for FP32 only
+struct WeightMatrix
+{
+    const float *data;
+    const void *packed;
+    const float *scales;
+    WeightPrecision precision;
+    unsigned rows;
+    unsigned cols;
+    WeightMatrix() :data(nullptr), packed(nullptr), scales(nullptr), precision(WeightPrecision::FP32), rows(0), cols(0) {}
+    Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>> mat() const
+    {
+        assert(WeightPrecision::FP32 == precision);
+        return Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>>(data, rows, cols);
+    }
+    Eigen::Map<const Eigen::VectorXf> vec() const
+    {
+        assert(WeightPrecision::FP32 == precision);
+        return Eigen::Map<const Eigen::VectorXf>(data, rows * cols);
+    }
+    // fp32 rows are viewed in place , low precision ones are widened into `buffer` of `cols` floats
+    Eigen::Map<const Eigen::VectorXf> row(unsigned r, float *buffer) const;
+    void copy_row(unsigned r, float *out) const; // `out` of `cols` floats
+    void multiply_add(const Eigen::MatrixXf &X, Eigen::MatrixXf &Y) const; // Y += W * X
+    std::size_t bytes() const;
+};
+
+struct DecodeOptions
+{
+    unsigned beam_width; // 1 means greedy decoding
+    bool use_shortlist; // restrict the output layer to the vocabulary shortlist , if the engine has one
+    SamplingParams sampling; // temperature > 0 samples every character , beam_width is ignored then
+    unsigned long long seed; // of the sampling RNG , the same seed gives the same poem
+    // beam search narrows its beam when the remaining lines wouldn't be finished by then , down to greedy
+    std::chrono::steady_clock::time_point deadline;
+    DecodeOptions() :beam_width(1U), use_shortlist(true), seed(0U), deadline(std::chrono::steady_clock::time_point::max()) {}
+    bool is_sampling() const { return sampling.temperature > 0.f; }
+    bool has_deadline() const { return deadline != std::chrono::steady_clock::time_point::max(); }
+};
+
+struct ScoredPoem
+{
+    Poem poem;
+    float log_prob; // of the generated lines , normalized over the shortlist when one is used ; NaN when not asked for
+};
+
+// a greedy decoder of one poem shape replacing the generic one , e.g. the kernels generated for one model by
+// `poem_generate codegen`
+class GreedyKernel
+{
+public:
+    virtual ~GreedyKernel() {}
+    // `need_log_prob` false leaves `generated_poem.log_prob` NaN , saving the softmax normalizer of every step
+    virtual void generate(const IndexSeq &first_seq, ScoredPoem &generated_poem, bool need_log_prob = true) const = 0;
+};
+
+// decoder output layer restricted to the candidate words of one request : output row `i` scores `words[i]`
+struct OutputShortlist
+{
+    IndexSeq words;
+    Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> w;
+    Eigen::VectorXf b;
+};
+
+// weights of stacked SimpleRNN : h_t = tanh(hb + x2h * x_t + h2h * h_{t-1})
+struct RNNWeights
+{
+    std::vector<WeightMatrix> x2h;
+    std::vector<WeightMatrix> h2h;
+    std::vector<WeightMatrix> hb;
+    // optional : hb + x2h * x of the first layer for every word (one row each) and for the start symbol
+    Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> input_projection;
+    Eigen::VectorXf start_projection;
+};
+
+struct InferenceEngine
+{
+    unsigned word_embedding_dim;
+    unsigned enc_h_dim;
+    unsigned enc_stacked_layer_num;
+    unsigned dec_h_dim;
+    unsigned dec_stacked_layer_num;
+    unsigned enc_hidden_layer_output_dim;
+    unsigned enc_output_layer_output_dim;
+    unsigned word_dict_size;
+    std::size_t max_history_len;
+    std::size_t poem_sent_num;
+
+    WeightMatrix words_lookup; // {word_dict_size , word_embedding_dim} , one row per word
+    WeightMatrix enc_SOS;
+    WeightMatrix enc_EOS;
+    WeightMatrix dec_SOS;
+    RNNWeights enc_l2r;
+    RNNWeights enc_r2l;
+    RNNWeights dec;
+    WeightMatrix enc_hidden_w;
+    WeightMatrix enc_hidden_b;
+    WeightMatrix enc_output_w[3];
+    WeightMatrix enc_output_b;
+    WeightMatrix dec_output_w;
+    WeightMatrix dec_output_b;
+
+    InferenceEngine();
+    // weight views point into the engine's own storage
+    InferenceEngine(const InferenceEngine&) = delete;
+    InferenceEngine &operator=(const InferenceEngine&) = delete;
+
+    // `mapped` : the binary model `pg` was loaded from , fp32 weights then point into its mapping instead of a copy
+    template <typename RNNType>
+    void load_from(const PoemGenerator<RNNType> &pg, std::shared_ptr<const MappedModelFile> mapped = nullptr);
+    // serving load without a cnn model : every fp32 weight points into a binary model of a SimpleRNN PoemGenerator
+    void load_from(std::shared_ptr<const MappedModelFile> mapped);
+    bool is_loaded() const { return words_lookup.rows > 0U; }
+    // lines of a generated poem : 4 (jueju) by default , or 8 (lushi) . greedy kernels of another line count are dropped
+    void set_poem_sent_num(std::size_t sent_num);
+    // re-pack the loaded weights at a lower precision , the float copies are released
+    void convert_weights(const WeightConversion &conversion);
+    WeightPrecision get_weight_precision() const { return weight_precision; }
+    void enable_encoder_cache(std::size_t capacity);
+    const EncoderStateCache *get_encoder_cache() const { return encoder_cache.get(); }
+    // run the right-to-left encoder direction on a helper thread , next to the left-to-right one
+    void enable_parallel_encoder(bool enabled);
+    bool is_parallel_encoder() const { return static_cast<bool>(encoder_helper); }
+    void set_vocab_shortlist(std::shared_ptr<const VocabShortlist> shortlist);
+    const VocabShortlist *get_vocab_shortlist() const { return vocab_shortlist.get(); }
+    // false if the full vocabulary should be used : no shortlist , or too few candidates for the no-repeat rule
+    bool make_output_shortlist(const IndexSeq &first_seq, unsigned beam_width, OutputShortlist &shortlist) const;
+
+    // precompute the first layer input of every RNN per word , so a step fetches a row instead of a matrix product
+    void build_projection_tables();
+    bool has_projection_tables() const { return dec.input_projection.size() > 0; }
+
+    // all states are batched : one column per sequence (or beam hypothesis) . word -1 is the start symbol
+    void lookup(const IndexSeq &words, Eigen::MatrixXf &X) const;
+    void encode(const std::vector<IndexSeq> &seqs, Eigen::MatrixXf &enc_hidden_output) const;
+    void init_decoder(const std::deque<Eigen::MatrixXf> &history, std::vector<Eigen::MatrixXf> &dec_h) const;
+    void decode_step(const IndexSeq &pre_words, std::vector<Eigen::MatrixXf> &dec_h, Eigen::MatrixXf &dist,
+        const OutputShortlist *shortlist = nullptr) const;
+    // encode the previous lines and init the decoder for line `generating_idx` ; the first line goes through the encoder cache
+    void prepare_decoder(const std::vector<IndexSeq> &cur_seqs, std::size_t generating_idx,
+        std::deque<Eigen::MatrixXf> &history, std::vector<Eigen::MatrixXf> &dec_h) const;
+
+    // `generate` and `generate_n_best` return true if the beam was narrowed for `opts.deadline`
+    bool generate(const IndexSeq &first_seq, Poem &generated_poem, const DecodeOptions &opts = DecodeOptions()) const;
+    // up to `n` poems from one encoder pass , the most probable first : `n` samples , or the top of a beam at least `n` wide
+    bool generate_n_best(const IndexSeq &first_seq, std::size_t n, std::vector<ScoredPoem> &generated_poems,
+        const DecodeOptions &opts = DecodeOptions()) const;
+    void greedy_search(const IndexSeq &first_seq, Poem &generated_poem, const OutputShortlist *shortlist = nullptr) const;
+    // greedy requests of `sent_len` words without a shortlist go to `kernel` , made for the current line count .
+    // nullptr for the built-in decoders
+    void set_greedy_kernel(std::size_t sent_len, std::shared_ptr<const GreedyKernel> kernel);
+    bool has_greedy_kernel(std::size_t sent_len) const { return greedy_kernels.count(sent_len) > 0; }
+    // `need_log_prob` false leaves the `log_prob` of a single sample NaN ; several samples are always scored , to be ranked
+    void sample_batch(const IndexSeq &first_seq, std::size_t nr_samples, const SamplingParams &params, unsigned long long seed,
+        std::vector<ScoredPoem> &generated_poems, const OutputShortlist *shortlist = nullptr, bool need_log_prob = true) const;
+    // the beam is narrowed before a line whose predicted time , from the time per hypothesis of the last line ,
+    // would overrun `deadline` ; fewer than `beam_width` poems may come back then , and it returns true
+    bool beam_search(const IndexSeq &first_seq, unsigned beam_width, std::vector<ScoredPoem> &generated_poems,
+        const OutputShortlist *shortlist = nullptr,
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) const;
+    // beam searches narrowed for their deadline
+    unsigned long long narrowed_beam_count() const { return nr_narrowed_beams; }
+    // output scores of every character of lines 1.. with the given lines fed back , one column per character
+    void teacher_forced_logits(const Poem &poem, Eigen::MatrixXf &logits) const;
+    // log probability of the generated lines under the full vocabulary , the first line given
+    float log_prob(const Poem &poem) const;
+
+    static const unsigned MaxBeamWidth = 64U;
+
+    std::size_t storage_bytes() const
+    {
+        return storage.size() * sizeof(float) + packed_storage.size()
+            + (enc_l2r.input_projection.size() + enc_r2l.input_projection.size() + dec.input_projection.size()) * sizeof(float);
+    }
+    // shared with every process mapping the same model file , not counted in `storage_bytes`
+    std::size_t mapped_bytes() const { return mapped_model ? mapped_model->size() : 0U; }
+    // bytes of every weight group (see `collect_weights`) and of the projection tables , owned or read from the mapping
+    struct GroupBytes
+    {
+        std::size_t owned;
+        std::size_t mapped;
+        GroupBytes() :owned(0U), mapped(0U) {}
+    };
+    void weight_bytes_by_group(std::map<std::string, GroupBytes> &groups);
+
+private:
+    static const std::size_t BlockAlignFloats = 16U; // 64 bytes
+    std::vector<float> storage;
+    std::size_t used_floats;
+    float *aligned_base;
+    std::vector<char> packed_storage; // low precision values , blocks aligned as `storage`
+    std::size_t used_packed_bytes;
+    char *packed_base;
+    WeightPrecision weight_precision;
+    std::shared_ptr<EncoderStateCache> encoder_cache;
+    std::shared_ptr<const VocabShortlist> vocab_shortlist;
+    std::unique_ptr<HelperThread> encoder_helper;
+    std::map<std::size_t, std::shared_ptr<const GreedyKernel>> greedy_kernels; // by line length
+    std::shared_ptr<const MappedModelFile> mapped_model;
+    std::map<const void*, const ModelFileParam*> mapped_params; // by cnn parameter , while loading from a mapping
+    mutable std::atomic<unsigned long long> nr_narrowed_beams;
+
+    void reset_storage(std::size_t nr_floats, std::size_t nr_blocks);
+    float *alloc_floats(std::size_t nr_floats);
+    void reset_packed_storage(std::size_t nr_bytes, std::size_t nr_blocks);
+    char *alloc_packed(std::size_t nr_bytes);
+    // every weight with its group : words_lookup , encoder , decoder , dec_output
+    void collect_weights(std::vector<std::pair<std::string, WeightMatrix*>> &weights);
+    void copy_param(const cnn::Parameters *p, WeightMatrix &out);
+    void copy_lookup_param(const cnn::LookupParameters *lp, WeightMatrix &out);
+    // point `out` into the mapped block of `p` , false if `p` isn't mapped
+    bool bind_mapped_param(const void *p, unsigned rows, unsigned cols, WeightMatrix &out);
+    void bind_mapped_block(const ModelFileParam &block, unsigned rows, unsigned cols, WeightMatrix &out);
+    void copy_rnn_params(const std::vector<cnn::Parameters*> &params_list, std::size_t offset, unsigned layers, RNNWeights &out);
+    // hb + x2h * x of the first layer for `words` , the start symbol of `rnn` is `start`
+    void first_layer_input(const RNNWeights &rnn, const WeightMatrix &start, const IndexSeq &words, Eigen::MatrixXf &Y) const;
+    static void rnn_step(const RNNWeights &rnn, const Eigen::MatrixXf &first_input, std::vector<Eigen::MatrixXf> &H);
+    // final states of one encoder direction , `reverse` reads the sequences right to left
+    void encode_direction(const RNNWeights &rnn, const WeightMatrix &start, const std::vector<IndexSeq> &seqs, bool reverse,
+        std::vector<Eigen::MatrixXf> &H) const;
+    void build_projection_table(const WeightMatrix &start, RNNWeights &rnn);
+    static void select_columns(const std::vector<unsigned> &cols, Eigen::MatrixXf &M);
+    // one greedy poem : by the compiled kernel of the line length , or the generic batched decoder
+    void greedy_search(const IndexSeq &first_seq, std::vector<ScoredPoem> &generated_poems, const OutputShortlist *shortlist,
+        bool need_log_prob) const;
+};
+
+// ------------------- template function definition --------------------
+
+template <typename RNNType>
+void InferenceEngine::load_from(const PoemGenerator<RNNType> &pg, std::shared_ptr<const MappedModelFile> mapped)
+{
+    static_assert(std::is_same<RNNType, cnn::SimpleRNNBuilder>::value,
+        "native inference engine only supports SimpleRNNBuilder");
+    word_embedding_dim = pg.word_embedding_dim;
+    enc_h_dim = pg.enc_h_dim;
+    enc_stacked_layer_num = pg.enc_stacked_layer_num;
+    dec_h_dim = pg.dec_h_dim;
+    dec_stacked_layer_num = pg.dec_stacked_layer_num;
+    enc_hidden_layer_output_dim = pg.enc_hidden_layer_output_dim;
+    enc_output_layer_output_dim = pg.enc_output_layer_output_dim;
+    word_dict_size = pg.word_dict_size;
+    max_history_len = PoemGenerator<RNNType>::MaxHistoryLen;
+    poem_sent_num = PoemGenerator<RNNType>::PoemSentNum;
+    greedy_kernels.clear(); // bound to the dimensions of the model before
+
+    // RNN builders keep their parameters private , but they are added to the model in construction order :
+    // [ l2r (x2h , h2h , hb) * layers ][ r2l ... ][ enc SOS ][ enc EOS ][ dec (x2h , h2h , hb) * layers ][ enc hidden w ] ...
+    const std::vector<cnn::Parameters*> &params_list = pg.m->parameters_list();
+    std::size_t enc_sos_pos = 0;
+    while (enc_sos_pos < params_list.size() && params_list[enc_sos_pos] != pg.bi_enc->SOS) ++enc_sos_pos;
+    std::size_t enc_rnn_param_num = 3U * enc_stacked_layer_num,
+        dec_rnn_param_num = 3U * dec_stacked_layer_num;
+    if (enc_sos_pos != 2U * enc_rnn_param_num
+        || params_list.size() <= enc_sos_pos + 2U + dec_rnn_param_num
+        || params_list.at(enc_sos_pos + 1U) != pg.bi_enc->EOS
+        || params_list.at(enc_sos_pos + 2U + dec_rnn_param_num) != pg.enc_hidden_layer->w)
+    {
+        throw std::runtime_error("unexpected parameter layout , failed to extract weights for native inference");
+    }
+
+    mapped_params.clear();
+    if (mapped)
+    {
+        if (mapped->header().rnn_type != static_cast<std::uint32_t>(ModelFileRNNType::SimpleRNN))
+        {
+            throw std::runtime_error("native inference engine only supports SimpleRNN models");
+        }
+        const ModelFileHeader &header = mapped->header();
+        const std::vector<cnn::LookupParameters*> &lookup_params_list = pg.m->lookup_parameters_list();
+        if (header.nr_params != params_list.size() || header.nr_lookup_params != lookup_params_list.size())
+        {
+            throw std::runtime_error("binary model doesn't match the model parameters");
+        }
+        for (std::size_t param_idx = 0; param_idx < params_list.size(); ++param_idx)
+        {
+            mapped_params[params_list[param_idx]] = &mapped->param(param_idx);
+        }
+        for (std::size_t param_idx = 0; param_idx < lookup_params_list.size(); ++param_idx)
+        {
+            mapped_params[lookup_params_list[param_idx]] = &mapped->lookup_param(param_idx);
+        }
+    }
+    mapped_model = mapped;
+    std::size_t nr_floats = 0U;
+    if (!mapped)
+    {
+        nr_floats = static_cast<std::size_t>(word_dict_size) * word_embedding_dim;
+        for (const cnn::Parameters *p : params_list) nr_floats += p->dim.size();
+    }
+    reset_storage(nr_floats, params_list.size() + 1U);
+
+    copy_rnn_params(params_list, 0U, enc_stacked_layer_num, enc_l2r);
+    copy_rnn_params(params_list, enc_rnn_param_num, enc_stacked_layer_num, enc_r2l);
+    copy_param(pg.bi_enc->SOS, enc_SOS);
+    copy_param(pg.bi_enc->EOS, enc_EOS);
+    copy_rnn_params(params_list, enc_sos_pos + 2U, dec_stacked_layer_num, dec);
+    copy_param(pg.enc_hidden_layer->w, enc_hidden_w);
+    copy_param(pg.enc_hidden_layer->b, enc_hidden_b);
+    copy_param(pg.enc_output_layer->w1, enc_output_w[0]);
+    copy_param(pg.enc_output_layer->w2, enc_output_w[1]);
+    copy_param(pg.enc_output_layer->w3, enc_output_w[2]);
+    copy_param(pg.enc_output_layer->b, enc_output_b);
+    copy_param(pg.dec_output_layer->w, dec_output_w);
+    copy_param(pg.dec_output_layer->b, dec_output_b);
+    copy_param(pg.DEC_SOS_param, dec_SOS);
+    copy_lookup_param(pg.words_lookup_param, words_lookup);
+    mapped_params.clear();
+    BOOST_LOG_TRIVIAL(info) << "native inference engine ready , weights " << storage_bytes() / (1 << 20) << " MB"
+        << " , mapped " << mapped_bytes() / (1 << 20) << " MB";
+}
+
+#endif
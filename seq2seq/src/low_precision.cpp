@@ -0,0 +1,280 @@
+#include "low_precision.h"
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <boost/archive/text_iarchive.hpp>
+#include <boost/archive/text_oarchive.hpp>
+#include <boost/serialization/map.hpp>
+#include <boost/serialization/string.hpp>
+// x86 builds convert halves with F16C / AVX2 when the running CPU has them : only those loops are compiled for the
+// extensions and they are picked at runtime , so the binaries still run on CPUs without them
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define LOW_PRECISION_X86_SIMD
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+const unsigned TileRows = 16U;
+using RowMajorMatrixXf = Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+
+#ifdef LOW_PRECISION_X86_SIMD
+bool cpu_has_f16c()
+{
+    static const bool supported = (__builtin_cpu_init(), __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c"));
+    return supported;
+}
+
+bool cpu_has_avx2()
+{
+    static const bool supported = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+    return supported;
+}
+
+// the vector loops below convert 8 values at a time and return how many they did , the caller finishes the tail
+
+__attribute__((target("avx,f16c"))) size_t narrow_fp16_f16c(const float *in, size_t n, uint16_t *out)
+{
+    size_t idx = 0;
+    for (; idx + 8U <= n; idx += 8U)
+    {
+        __m128i halves = _mm256_cvtps_ph(_mm256_loadu_ps(in + idx), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + idx), halves);
+    }
+    return idx;
+}
+
+__attribute__((target("avx,f16c"))) size_t widen_fp16_f16c(const uint16_t *in, size_t n, float *out)
+{
+    size_t idx = 0;
+    for (; idx + 8U <= n; idx += 8U)
+    {
+        __m128i halves = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + idx));
+        _mm256_storeu_ps(out + idx, _mm256_cvtph_ps(halves));
+    }
+    return idx;
+}
+
+__attribute__((target("avx2"))) size_t widen_bf16_avx2(const uint16_t *in, size_t n, float *out)
+{
+    size_t idx = 0;
+    for (; idx + 8U <= n; idx += 8U)
+    {
+        __m256i words = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + idx)));
+        _mm256_storeu_ps(out + idx, _mm256_castsi256_ps(_mm256_slli_epi32(words, 16)));
+    }
+    return idx;
+}
+#endif
+
+// Y += W * X , `widen_row(r , out)` writes row `r` of W as float
+template <typename WidenRow>
+void tiled_multiply_add(unsigned rows, unsigned cols, const Eigen::MatrixXf &X, Eigen::MatrixXf &Y, WidenRow widen_row)
+{
+    // the tile buffer stays in cache , it is kept per thread to avoid an allocation per call
+    thread_local vector<float> tile_buf;
+    tile_buf.resize(static_cast<size_t>(TileRows) * cols);
+    for (unsigned row_begin = 0; row_begin < rows; row_begin += TileRows)
+    {
+        unsigned tile_rows = std::min(TileRows, rows - row_begin);
+        for (unsigned r = 0; r < tile_rows; ++r) widen_row(row_begin + r, tile_buf.data() + static_cast<size_t>(r) * cols);
+        Eigen::Map<const RowMajorMatrixXf> tile(tile_buf.data(), tile_rows, cols);
+        Y.middleRows(row_begin, tile_rows).noalias() += tile * X;
+    }
+}
+
+inline uint32_t float_bits(float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+inline float bits_float(uint32_t bits)
+{
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+uint16_t float_to_half(float value)
+{
+    uint32_t bits = float_bits(value),
+        sign = (bits >> 16) & 0x8000U,
+        abs_bits = bits & 0x7FFFFFFFU;
+    if (abs_bits >= 0x7F800000U) return static_cast<uint16_t>(sign | 0x7C00U | (abs_bits > 0x7F800000U ? 0x200U : 0U)); // inf , nan
+    if (abs_bits >= 0x477FF000U) return static_cast<uint16_t>(sign | 0x7C00U); // overflow
+    if (abs_bits < 0x38800000U)
+    {
+        // subnormal half : scale into the integer range , the float add rounds to nearest even
+        float magic = bits_float(0x3F000000U); // 0.5 , ulp of the result is 2^-24
+        uint32_t sub_bits = float_bits(bits_float(abs_bits) + magic) - float_bits(magic);
+        return static_cast<uint16_t>(sign | sub_bits);
+    }
+    uint32_t mantissa_odd = (abs_bits >> 13) & 1U;
+    abs_bits += 0xC8000FFFU + mantissa_odd; // rebias exponent by -112 , round to nearest even
+    return static_cast<uint16_t>(sign | (abs_bits >> 13));
+}
+
+float half_to_float(uint16_t half)
+{
+    uint32_t sign = static_cast<uint32_t>(half & 0x8000U) << 16,
+        exponent = (half >> 10) & 0x1FU,
+        mantissa = half & 0x3FFU;
+    if (0U == exponent)
+    {
+        // zero or subnormal : mantissa * 2^-24
+        float value = static_cast<float>(mantissa) * bits_float(0x33800000U);
+        return bits_float(float_bits(value) | sign);
+    }
+    if (0x1FU == exponent) return bits_float(sign | 0x7F800000U | (mantissa << 13));
+    return bits_float(sign | ((exponent + 112U) << 23) | (mantissa << 13));
+}
+}
+
+const char *weight_precision_name(WeightPrecision precision)
+{
+    switch (precision)
+    {
+    case WeightPrecision::INT8: return "int8";
+    case WeightPrecision::FP16: return "fp16";
+    case WeightPrecision::BF16: return "bf16";
+    default: return "fp32";
+    }
+}
+
+bool parse_weight_precision(const string &name, WeightPrecision &precision)
+{
+    if (name == "fp32") precision = WeightPrecision::FP32;
+    else if (name == "int8") precision = WeightPrecision::INT8;
+    else if (name == "fp16") precision = WeightPrecision::FP16;
+    else if (name == "bf16") precision = WeightPrecision::BF16;
+    else return false;
+    return true;
+}
+
+size_t weight_precision_bytes(WeightPrecision precision)
+{
+    switch (precision)
+    {
+    case WeightPrecision::INT8: return 1U;
+    case WeightPrecision::FP16:
+    case WeightPrecision::BF16: return 2U;
+    default: return sizeof(float);
+    }
+}
+
+float WeightConversion::clip_ratio(const string &group) const
+{
+    map<string, float>::const_iterator ite = clip_ratios.find(group);
+    return ite == clip_ratios.end() ? 1.f : ite->second;
+}
+
+void WeightConversion::save(ostream &os) const
+{
+    boost::archive::text_oarchive to(os);
+    int precision_value = static_cast<int>(precision);
+    to << precision_value << clip_ratios;
+}
+
+void WeightConversion::load(istream &is)
+{
+    boost::archive::text_iarchive ti(is);
+    int precision_value;
+    ti >> precision_value >> clip_ratios;
+    precision = static_cast<WeightPrecision>(precision_value);
+}
+
+namespace low_precision
+{
+
+float quantize_row_int8(const float *row, size_t cols, float clip_ratio, int8_t *out)
+{
+    float max_abs = 0.f;
+    for (size_t c = 0; c < cols; ++c) max_abs = std::max(max_abs, std::fabs(row[c]));
+    float scale = max_abs * clip_ratio / 127.f;
+    if (scale <= 0.f)
+    {
+        std::fill(out, out + cols, 0);
+        return 1.f;
+    }
+    for (size_t c = 0; c < cols; ++c)
+    {
+        float q = std::round(row[c] / scale);
+        out[c] = static_cast<int8_t>(std::max(-127.f, std::min(127.f, q)));
+    }
+    return scale;
+}
+
+void widen_int8(const int8_t *in, size_t n, float scale, float *out)
+{
+    Eigen::Map<Eigen::VectorXf>(out, n) = Eigen::Map<const Eigen::Matrix<int8_t, Eigen::Dynamic, 1>>(in, n).cast<float>() * scale;
+}
+
+void narrow_fp16(const float *in, size_t n, uint16_t *out)
+{
+    size_t idx = 0;
+#ifdef LOW_PRECISION_X86_SIMD
+    if (cpu_has_f16c()) idx = narrow_fp16_f16c(in, n, out);
+#endif
+    for (; idx < n; ++idx) out[idx] = float_to_half(in[idx]);
+}
+
+void widen_fp16(const uint16_t *in, size_t n, float *out)
+{
+    size_t idx = 0;
+#ifdef LOW_PRECISION_X86_SIMD
+    if (cpu_has_f16c()) idx = widen_fp16_f16c(in, n, out);
+#endif
+    for (; idx < n; ++idx) out[idx] = half_to_float(in[idx]);
+}
+
+void narrow_bf16(const float *in, size_t n, uint16_t *out)
+{
+    for (size_t idx = 0; idx < n; ++idx)
+    {
+        uint32_t bits = float_bits(in[idx]);
+        if ((bits & 0x7FFFFFFFU) > 0x7F800000U) out[idx] = static_cast<uint16_t>((bits >> 16) | 0x40U); // keep nan quiet
+        else out[idx] = static_cast<uint16_t>((bits + 0x7FFFU + ((bits >> 16) & 1U)) >> 16);
+    }
+}
+
+void widen_bf16(const uint16_t *in, size_t n, float *out)
+{
+    size_t idx = 0;
+#ifdef LOW_PRECISION_X86_SIMD
+    if (cpu_has_avx2()) idx = widen_bf16_avx2(in, n, out);
+#endif
+    for (; idx < n; ++idx) out[idx] = bits_float(static_cast<uint32_t>(in[idx]) << 16);
+}
+
+void int8_multiply_add(const int8_t *Q, const float *scales, unsigned rows, unsigned cols,
+    const Eigen::MatrixXf &X, Eigen::MatrixXf &Y)
+{
+    tiled_multiply_add(rows, cols, X, Y, [Q, scales, cols](unsigned r, float *out)
+    {
+        widen_int8(Q + static_cast<size_t>(r) * cols, cols, scales[r], out);
+    });
+}
+
+void fp16_multiply_add(const uint16_t *W, unsigned rows, unsigned cols, const Eigen::MatrixXf &X, Eigen::MatrixXf &Y)
+{
+    tiled_multiply_add(rows, cols, X, Y, [W, cols](unsigned r, float *out)
+    {
+        widen_fp16(W + static_cast<size_t>(r) * cols, cols, out);
+    });
+}
+
+void bf16_multiply_add(const uint16_t *W, unsigned rows, unsigned cols, const Eigen::MatrixXf &X, Eigen::MatrixXf &Y)
+{
+    tiled_multiply_add(rows, cols, X, Y, [W, cols](unsigned r, float *out)
+    {
+        widen_bf16(W + static_cast<size_t>(r) * cols, cols, out);
+    });
+}
+
+}
@@ -0,0 +1,59 @@
+#ifndef LOW_PRECISION_H_INCLUDED
+#define LOW_PRECISION_H_INCLUDED
+#include <map>
+#include <string>
+#include <cstdint>
+#include <iostream>
+#include <Eigen/Dense>
+
+/*
+ * Low precision storage of the served weights .
+ * INT8 : symmetric per-row quantization , w[r][c] ~= scale[r] * q[r][c] , q in [-127 , 127] .
+ * FP16 / BF16 : IEEE half and bfloat16 , rounded to nearest even . F16C / AVX2 convert halves when the CPU has them .
+ * matrices are multiplied a tile of rows at a time : the tile is widened to float in a small buffer ,
+ * so the weights are streamed from memory at 1 or 2 bytes per value .
+ */
+
+enum class WeightPrecision
+{
+    FP32,
+    INT8,
+    FP16,
+    BF16
+};
+
+const char *weight_precision_name(WeightPrecision precision);
+bool parse_weight_precision(const std::string &name, WeightPrecision &precision);
+std::size_t weight_precision_bytes(WeightPrecision precision);
+
+// how the weights of the native engine are converted after loading
+struct WeightConversion
+{
+    WeightPrecision precision;
+    // INT8 rows are clipped to `ratio * max |w|` before scaling , per weight group . found by calibration
+    std::map<std::string, float> clip_ratios;
+
+    WeightConversion() :precision(WeightPrecision::FP32) {}
+    float clip_ratio(const std::string &group) const;
+    void save(std::ostream &os) const;
+    void load(std::istream &is);
+};
+
+namespace low_precision
+{
+// quantize one row to `out` , returns its scale
+float quantize_row_int8(const float *row, std::size_t cols, float clip_ratio, std::int8_t *out);
+void widen_int8(const std::int8_t *in, std::size_t n, float scale, float *out);
+void narrow_fp16(const float *in, std::size_t n, std::uint16_t *out);
+void widen_fp16(const std::uint16_t *in, std::size_t n, float *out);
+void narrow_bf16(const float *in, std::size_t n, std::uint16_t *out);
+void widen_bf16(const std::uint16_t *in, std::size_t n, float *out);
+// Y += diag(scales) * Q * X , Q is {rows , cols} row-major
+void int8_multiply_add(const std::int8_t *Q, const float *scales, unsigned rows, unsigned cols,
+    const Eigen::MatrixXf &X, Eigen::MatrixXf &Y);
+// Y += W * X , W is {rows , cols} row-major fp16 or bf16
+void fp16_multiply_add(const std::uint16_t *W, unsigned rows, unsigned cols, const Eigen::MatrixXf &X, Eigen::MatrixXf &Y);
+void bf16_multiply_add(const std::uint16_t *W, unsigned rows, unsigned cols, const Eigen::MatrixXf &X, Eigen::MatrixXf &Y);
+}
+
+#endif
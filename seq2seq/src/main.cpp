@@ -1,5 +1,6 @@
 #include <boost/program_options.hpp>
 #include <boost/log/trivial.hpp>
+#include <chrono>
 #include "cnn/lstm.h"
 #include "poem_generate_handler.h"
 
@@ -16,6 +17,7 @@ int train_process(int argc, char *argv[], const string &program_name)
     op_des.add_options()
         ("training_data", po::value<string>(), "The path to training data")
         ("max_epoch", po::value<unsigned>()->default_value(4), "The epoch to iterate for training")
+        ("graph_replay", "Build the training graph once per poem shape and replay it with new indices , poems of one shape are trained in runs .")
         ("model", po::value<string>(), "Use to specify the model name(path)")
         ("word_embedding_dim", po::value<unsigned>()->default_value(50), "The dimension for dynamic channel word embedding.")
         ("enc_stacked_layer_num", po::value<unsigned>()->default_value(3), "The number of stacked layers in encoder bi-LSTM.")
@@ -61,6 +63,7 @@ int train_process(int argc, char *argv[], const string &program_name)
 
     // build model structure
     pgh.build_model(); // passing the var_map to specify the model structure
+    if (var_map.count("graph_replay")) pgh.enable_graph_replay();
 
 
                                  // reading developing data
@@ -89,6 +92,32 @@ int train_process(int argc, char *argv[], const string &program_name)
     return 0;
 }
 
+// `--calibration` gives the whole conversion , `--weight_precision` other than fp32 overrides its precision
+bool load_weight_conversion(const po::variables_map &var_map, WeightConversion &conversion)
+{
+    if (var_map.count("calibration"))
+    {
+        string calibration_path = var_map["calibration"].as<string>();
+        ifstream calibration_is(calibration_path);
+        if (!calibration_is)
+        {
+            BOOST_LOG_TRIVIAL(fatal) << "Failed to open calibration at '" << calibration_path << "' . \n"
+                "Exit .";
+            return false;
+        }
+        conversion.load(calibration_is);
+    }
+    WeightPrecision precision;
+    if (!parse_weight_precision(var_map["weight_precision"].as<string>(), precision))
+    {
+        BOOST_LOG_TRIVIAL(fatal) << "unknown weight precision : " << var_map["weight_precision"].as<string>() << " .\n"
+            "Exit .";
+        return false;
+    }
+    if (precision != WeightPrecision::FP32) conversion.precision = precision;
+    return true;
+}
+
 int generate_process(int argc, char *argv[], const string &program_name)
 {
     string description = PROGRAM_DESCRIPTION + "\n"
@@ -98,6 +127,20 @@ int generate_process(int argc, char *argv[], const string &program_name)
     op_des.add_options()
         ("first_seq", po::value<string>(), "The first sequence .")
         ("model", po::value<string>(), "Use to specify the model name(path)")
+        ("native", "Generate with the graph-free native inference engine instead of CNN computation graph.")
+        ("graph_replay", "Replay one CNN computation graph per poem shape instead of building one per poem (without `--native`).")
+        ("poem_lines", po::value<unsigned>()->default_value(4), "Lines of the generated poem : 4 (jueju) or 8 (lushi) .")
+        ("beam_width", po::value<unsigned>()->default_value(1), "Beam width for decoding , 1 for greedy . Beam search implies `--native` .")
+        ("shortlist", po::value<string>(), "Vocabulary shortlist built by `shortlist` mode , implies `--native` .")
+        ("temperature", po::value<float>()->default_value(0.f), "Sample every character at this temperature , 0 to decode without sampling . Sampling implies `--native` .")
+        ("top_k", po::value<unsigned>()->default_value(0), "Sample from the top k characters only , 0 for no limit , at most 256 .")
+        ("top_p", po::value<float>()->default_value(1.f), "Sample from the smallest set of characters with this probability mass (nucleus) , 1 for no limit .")
+        ("seed", po::value<unsigned long long>()->default_value(0), "Seed of sampling , the same seed gives the same poem .")
+        ("n", po::value<unsigned>()->default_value(1), "Number of candidate poems , printed with their log probabilities if more than 1 . Implies `--native` .")
+        ("weight_precision", po::value<string>()->default_value("fp32"), "Precision of the native engine weights : fp32 , int8 , fp16 or bf16 . Non fp32 implies `--native` .")
+        ("calibration", po::value<string>(), "Weight conversion calibrated by `quantize` mode , implies `--native` .")
+        ("projection_tables", "Precompute the first layer input of every RNN per character , implies `--native` .")
+        ("parallel_encoder", "Run the two encoder directions on two threads , implies `--native` .")
         ("help,h", "Show help information.");
     po::variables_map var_map;
     po::store(po::command_line_parser(argc, argv).options(op_des).allow_unregistered().run(), var_map);
@@ -126,6 +169,20 @@ int generate_process(int argc, char *argv[], const string &program_name)
     }
     else model_path = var_map["model"].as<string>();
 
+    unsigned poem_lines = var_map["poem_lines"].as<unsigned>();
+    if (poem_lines != 4U && poem_lines != 8U)
+    {
+        BOOST_LOG_TRIVIAL(fatal) << "Poem lines should be 4 or 8 , got " << poem_lines << " .\n"
+            "Exit!";
+        return -1;
+    }
+    if (var_map["top_k"].as<unsigned>() > MaxSampleCandidates)
+    {
+        BOOST_LOG_TRIVIAL(fatal) << "Top k should be at most " << MaxSampleCandidates << " .\n"
+            "Exit!";
+        return -1;
+    }
+
     // Init 
     cnn::Initialize(argc, argv, 1234);
     PoemGeneratorHandler<cnn::SimpleRNNBuilder> pgh ;
@@ -138,10 +195,55 @@ int generate_process(int argc, char *argv[], const string &program_name)
             "Exit .";
         return -1;
     }
-    pgh.load_model(is);
     is.close();
+    pgh.load_model(model_path);
+    pgh.set_poem_sent_num(poem_lines);
+    DecodeOptions decode_opts;
+    decode_opts.beam_width = var_map["beam_width"].as<unsigned>();
+    decode_opts.sampling.temperature = var_map["temperature"].as<float>();
+    decode_opts.sampling.top_k = var_map["top_k"].as<unsigned>();
+    decode_opts.sampling.top_p = var_map["top_p"].as<float>();
+    decode_opts.seed = var_map["seed"].as<unsigned long long>();
+    WeightConversion conversion;
+    if (!load_weight_conversion(var_map, conversion)) return -1;
+    unsigned n = var_map["n"].as<unsigned>();
+    if (var_map.count("native") || var_map.count("shortlist") || decode_opts.beam_width > 1U || decode_opts.is_sampling()
+        || n > 1U || conversion.precision != WeightPrecision::FP32 || var_map.count("projection_tables")
+        || var_map.count("parallel_encoder"))
+    {
+        pgh.enable_native_engine();
+        pgh.engine.convert_weights(conversion);
+        if (var_map.count("projection_tables")) pgh.engine.build_projection_tables();
+        pgh.engine.enable_parallel_encoder(var_map.count("parallel_encoder") > 0);
+    }
+    else if (var_map.count("graph_replay")) pgh.enable_graph_replay();
+    if (var_map.count("shortlist"))
+    {
+        string shortlist_path = var_map["shortlist"].as<string>();
+        ifstream shortlist_is(shortlist_path);
+        if (!shortlist_is)
+        {
+            BOOST_LOG_TRIVIAL(fatal) << "Failed to open shortlist at '" << shortlist_path << "' . \n"
+                "Exit .";
+            return -1;
+        }
+        pgh.load_shortlist(shortlist_is);
+    }
+    if (n > 1U)
+    {
+        vector<vector<string>> generated_poems;
+        vector<float> log_probs;
+        pgh.generate_n_best(first_seq, n, generated_poems, log_probs, decode_opts);
+        for (size_t poem_idx = 0; poem_idx < generated_poems.size(); ++poem_idx)
+        {
+            cout << "log_prob\t" << log_probs.at(poem_idx) << endl;
+            for (const string &sent : generated_poems.at(poem_idx)) cout << sent << endl;
+            cout << endl;
+        }
+        return 0;
+    }
     vector<string> generated_poem;
-    pgh.generate(first_seq, generated_poem);
+    pgh.generate(first_seq, generated_poem, decode_opts);
     for (size_t idx = 0; idx < generated_poem.size(); ++idx)
     {
         cout << generated_poem.at(idx) << endl;
@@ -149,11 +251,445 @@ int generate_process(int argc, char *argv[], const string &program_name)
     return 0;
 }
 
+// generate every test poem with the full vocabulary and with the shortlist , report quality and latency side by side
+void report_shortlist(const InferenceEngine &engine, const vector<Poem> &test_poems, unsigned beam_width)
+{
+    DecodeOptions full_opts,
+        shortlist_opts;
+    full_opts.beam_width = shortlist_opts.beam_width = beam_width;
+    full_opts.use_shortlist = false;
+    double full_ms = 0., shortlist_ms = 0.,
+        full_log_prob = 0., shortlist_log_prob = 0.;
+    size_t nr_poems = 0, nr_fallback = 0, sum_shortlist_size = 0,
+        nr_words = 0, nr_same_words = 0, nr_same_poems = 0;
+    for (const Poem &test_poem : test_poems)
+    {
+        if (test_poem.empty() || test_poem[0].empty()) continue;
+        const IndexSeq &first_seq = test_poem[0];
+        OutputShortlist shortlist;
+        if (engine.make_output_shortlist(first_seq, beam_width, shortlist)) sum_shortlist_size += shortlist.words.size();
+        else ++nr_fallback;
+        Poem full_poem, shortlist_poem;
+        auto time_start = chrono::high_resolution_clock::now();
+        engine.generate(first_seq, full_poem, full_opts);
+        auto time_mid = chrono::high_resolution_clock::now();
+        engine.generate(first_seq, shortlist_poem, shortlist_opts);
+        auto time_end = chrono::high_resolution_clock::now();
+        full_ms += chrono::duration<double, milli>(time_mid - time_start).count();
+        shortlist_ms += chrono::duration<double, milli>(time_end - time_mid).count();
+        full_log_prob += engine.log_prob(full_poem);
+        shortlist_log_prob += engine.log_prob(shortlist_poem);
+        for (size_t sent_idx = 1; sent_idx < full_poem.size(); ++sent_idx)
+        {
+            for (size_t word_idx = 0; word_idx < full_poem[sent_idx].size(); ++word_idx)
+            {
+                ++nr_words;
+                if (full_poem[sent_idx][word_idx] == shortlist_poem[sent_idx][word_idx]) ++nr_same_words;
+            }
+        }
+        if (full_poem == shortlist_poem) ++nr_same_poems;
+        ++nr_poems;
+    }
+    if (0U == nr_poems)
+    {
+        BOOST_LOG_TRIVIAL(warning) << "no test poem to report .";
+        return;
+    }
+    size_t nr_shortlisted = nr_poems - nr_fallback;
+    cout << "poems : " << nr_poems << " , fallback to full vocabulary : " << nr_fallback
+        << " , average shortlist size : " << (nr_shortlisted ? sum_shortlist_size / nr_shortlisted : 0U)
+        << " / " << engine.word_dict_size << "\n"
+        << "                    full vocabulary\tshortlist\n"
+        << "latency (ms/poem) : " << full_ms / nr_poems << "\t" << shortlist_ms / nr_poems << "\n"
+        << "log prob (/poem)  : " << full_log_prob / nr_poems << "\t" << shortlist_log_prob / nr_poems << "\n"
+        << "same words : " << static_cast<double>(nr_same_words) / std::max<size_t>(nr_words, 1U)
+        << " , same poems : " << static_cast<double>(nr_same_poems) / nr_poems << endl;
+}
+
+int shortlist_process(int argc, char *argv[], const string &program_name)
+{
+    string description = PROGRAM_DESCRIPTION + "\n"
+        "Shortlist process .\n"
+        "using `" + program_name + " shortlist <options>` to build the vocabulary shortlist for decoding , "
+        "and optionally report it against the full vocabulary on test data . shortlist options are as following";
+    po::options_description op_des = po::options_description(description);
+    op_des.add_options()
+        ("training_data", po::value<string>(), "The path to training data , to count words")
+        ("model", po::value<string>(), "Use to specify the model name(path)")
+        ("shortlist", po::value<string>(), "The path to save the shortlist")
+        ("head_size", po::value<unsigned>()->default_value(300), "The number of most frequent words always in the shortlist")
+        ("per_word_size", po::value<unsigned>()->default_value(100), "The number of co-occurring words added for every first line word")
+        ("test_data", po::value<string>(), "The path to test data , in training data format . report quality and latency if given")
+        ("beam_width", po::value<unsigned>()->default_value(1), "Beam width for the report")
+        ("help,h", "Show help information.");
+    po::variables_map var_map;
+    po::store(po::command_line_parser(argc, argv).options(op_des).allow_unregistered().run(), var_map);
+    po::notify(var_map);
+    if (var_map.count("help"))
+    {
+        cerr << op_des << endl;
+        return 0;
+    }
+    if (0 == var_map.count("training_data") || 0 == var_map.count("model") || 0 == var_map.count("shortlist"))
+    {
+        BOOST_LOG_TRIVIAL(fatal) << "training data , model and shortlist path should be specified ! \n"
+            "using `" + program_name + " shortlist -h ` to see detail parameters .\n"
+            "Exit .";
+        return -1;
+    }
+    string training_data_path = var_map["training_data"].as<string>(),
+        model_path = var_map["model"].as<string>(),
+        shortlist_path = var_map["shortlist"].as<string>();
+
+    // Init 
+    cnn::Initialize(argc, argv, 1234);
+    PoemGeneratorHandler<cnn::SimpleRNNBuilder> pgh;
+    ifstream is(model_path);
+    if (!is)
+    {
+        BOOST_LOG_TRIVIAL(fatal) << "Failed to open model path at '" << model_path << "' . \n"
+            "Exit .";
+        return -1;
+    }
+    is.close();
+    pgh.load_model(model_path);
+    pgh.enable_native_engine();
+
+    // the dict is frozen , unknown words of the data become UNK
+    ifstream train_is(training_data_path);
+    if (!train_is)
+    {
+        BOOST_LOG_TRIVIAL(fatal) << "failed to open training: `" << training_data_path << "` .\n Exit! \n";
+        return -1;
+    }
+    vector<Poem> poems;
+    pgh.read_train_data(train_is, poems);
+    train_is.close();
+    shared_ptr<VocabShortlist> shortlist = make_shared<VocabShortlist>();
+    shortlist->build(poems, pgh.pg.word_dict_size, var_map["head_size"].as<unsigned>(), var_map["per_word_size"].as<unsigned>());
+    ofstream os(shortlist_path);
+    if (!os)
+    {
+        BOOST_LOG_TRIVIAL(fatal) << "failed to open shortlist path at '" << shortlist_path << "'. \n Exit !";
+        return -1;
+    }
+    shortlist->save(os);
+    os.close();
+
+    if (var_map.count("test_data"))
+    {
+        string test_data_path = var_map["test_data"].as<string>();
+        ifstream test_is(test_data_path);
+        if (!test_is)
+        {
+            BOOST_LOG_TRIVIAL(fatal) << "failed to open test data: `" << test_data_path << "` .\n Exit! \n";
+            return -1;
+        }
+        vector<Poem> test_poems;
+        pgh.read_train_data(test_is, test_poems);
+        pgh.engine.set_vocab_shortlist(shortlist);
+        report_shortlist(pgh.engine, test_poems, var_map["beam_width"].as<unsigned>());
+    }
+    return 0;
+}
+
+struct LogitDivergence
+{
+    float max_diff;
+    double mean_diff;
+    double argmax_agreement;
+};
+
+// teacher forced output scores of the two engines on the same poems
+LogitDivergence logit_divergence(const InferenceEngine &reference, const InferenceEngine &engine, const vector<Poem> &poems)
+{
+    LogitDivergence divergence = { 0.f, 0., 0. };
+    size_t nr_steps = 0U,
+        nr_same_argmax = 0U;
+    Eigen::MatrixXf reference_logits, logits;
+    for (const Poem &poem : poems)
+    {
+        reference.teacher_forced_logits(poem, reference_logits);
+        engine.teacher_forced_logits(poem, logits);
+        for (Eigen::Index step_idx = 0; step_idx < logits.cols(); ++step_idx)
+        {
+            Eigen::Index reference_argmax, argmax;
+            reference_logits.col(step_idx).maxCoeff(&reference_argmax);
+            logits.col(step_idx).maxCoeff(&argmax);
+            if (reference_argmax == argmax) ++nr_same_argmax;
+        }
+        Eigen::ArrayXXf diff = (reference_logits - logits).array().abs();
+        if (diff.size() > 0) divergence.max_diff = std::max(divergence.max_diff, diff.maxCoeff());
+        divergence.mean_diff += diff.sum();
+        nr_steps += logits.cols();
+    }
+    if (nr_steps > 0U)
+    {
+        divergence.mean_diff /= static_cast<double>(nr_steps) * reference.word_dict_size;
+        divergence.argmax_agreement = static_cast<double>(nr_same_argmax) / nr_steps;
+    }
+    return divergence;
+}
+
+// average greedy generation time of the first lines , in ms
+double generation_latency(const InferenceEngine &engine, const vector<Poem> &poems)
+{
+    DecodeOptions opts;
+    Poem generated_poem;
+    auto time_start = chrono::high_resolution_clock::now();
+    for (const Poem &poem : poems) engine.generate(poem[0], generated_poem, opts);
+    auto time_end = chrono::high_resolution_clock::now();
+    return poems.empty() ? 0. : chrono::duration<double, milli>(time_end - time_start).count() / poems.size();
+}
+
+int quantize_process(int argc, char *argv[], const string &program_name)
+{
+    string description = PROGRAM_DESCRIPTION + "\n"
+        "Quantize process .\n"
+        "using `" + program_name + " quantize <options>` to calibrate the weight conversion of the native engine on held-out poems , "
+        "and report it against the float model . quantize options are as following";
+    po::options_description op_des = po::options_description(description);
+    op_des.add_options()
+        ("model", po::value<string>(), "Use to specify the model name(path)")
+        ("test_data", po::value<string>(), "The path to held-out poems , in training data format")
+        ("weight_precision", po::value<string>()->default_value("int8"), "Target precision : int8 (calibrated) , fp16 or bf16 (verified only)")
+        ("calibration", po::value<string>(), "The path to save the calibrated conversion")
+        ("max_poems", po::value<unsigned>()->default_value(200), "The max number of held-out poems to use")
+        ("help,h", "Show help information.");
+    po::variables_map var_map;
+    po::store(po::command_line_parser(argc, argv).options(op_des).allow_unregistered().run(), var_map);
+    po::notify(var_map);
+    if (var_map.count("help"))
+    {
+        cerr << op_des << endl;
+        return 0;
+    }
+    if (0 == var_map.count("model") || 0 == var_map.count("test_data"))
+    {
+        BOOST_LOG_TRIVIAL(fatal) << "model and test data should be specified ! \n"
+            "using `" + program_name + " quantize -h ` to see detail parameters .\n"
+            "Exit .";
+        return -1;
+    }
+    WeightConversion conversion;
+    if (!parse_weight_precision(var_map["weight_precision"].as<string>(), conversion.precision))
+    {
+        BOOST_LOG_TRIVIAL(fatal) << "unknown weight precision : " << var_map["weight_precision"].as<string>() << " .\n"
+            "Exit .";
+        return -1;
+    }
+    string model_path = var_map["model"].as<string>(),
+        test_data_path = var_map["test_data"].as<string>();
+
+    // Init 
+    cnn::Initialize(argc, argv, 1234);
+    PoemGeneratorHandler<cnn::SimpleRNNBuilder> pgh;
+    ifstream is(model_path);
+    if (!is)
+    {
+        BOOST_LOG_TRIVIAL(fatal) << "Failed to open model path at '" << model_path << "' . \n"
+            "Exit .";
+        return -1;
+    }
+    is.close();
+    pgh.load_model(model_path);
+    pgh.enable_native_engine();
+    ifstream test_is(test_data_path);
+    if (!test_is)
+    {
+        BOOST_LOG_TRIVIAL(fatal) << "failed to open test data: `" << test_data_path << "` .\n Exit! \n";
+        return -1;
+    }
+    vector<Poem> poems, test_poems;
+    pgh.read_train_data(test_is, poems);
+    test_is.close();
+    for (const Poem &poem : poems)
+    {
+        if (test_poems.size() >= var_map["max_poems"].as<unsigned>()) break;
+        if (poem.size() >= 2U && !poem[0].empty()) test_poems.push_back(poem);
+    }
+
+    InferenceEngine engine;
+    if (WeightPrecision::INT8 == conversion.precision)
+    {
+        // per group , the clip ratio with the least mean logit divergence ; the other groups keep their best so far
+        const float clip_ratios[] = { 1.f, 0.95f, 0.9f, 0.85f, 0.8f, 0.7f };
+        for (const char *group : { "encoder", "decoder", "dec_output" })
+        {
+            float best_clip_ratio = 1.f;
+            double best_mean_diff = numeric_limits<double>::max();
+            for (float clip_ratio : clip_ratios)
+            {
+                conversion.clip_ratios[group] = clip_ratio;
+                engine.load_from(pgh.pg);
+                engine.convert_weights(conversion);
+                LogitDivergence divergence = logit_divergence(pgh.engine, engine, test_poems);
+                BOOST_LOG_TRIVIAL(info) << "calibrating " << group << " , clip ratio " << clip_ratio
+                    << " , mean logit divergence " << divergence.mean_diff;
+                if (divergence.mean_diff < best_mean_diff)
+                {
+                    best_mean_diff = divergence.mean_diff;
+                    best_clip_ratio = clip_ratio;
+                }
+            }
+            conversion.clip_ratios[group] = best_clip_ratio;
+        }
+    }
+    engine.load_from(pgh.pg);
+    engine.convert_weights(conversion);
+    LogitDivergence divergence = logit_divergence(pgh.engine, engine, test_poems);
+    cout << "poems : " << test_poems.size() << "\n"
+        << "                     fp32\t" << weight_precision_name(conversion.precision) << "\n"
+        << "weights (bytes)    : " << pgh.engine.storage_bytes() << "\t" << engine.storage_bytes() << "\n"
+        << "latency (ms/poem)  : " << generation_latency(pgh.engine, test_poems) << "\t" << generation_latency(engine, test_poems) << "\n"
+        << "max logit divergence : " << divergence.max_diff << " , mean : " << divergence.mean_diff
+        << " , argmax agreement : " << divergence.argmax_agreement << endl;
+    for (const auto &clip_ratio : conversion.clip_ratios) cout << "clip ratio of " << clip_ratio.first << " : " << clip_ratio.second << "\n";
+    if (var_map.count("calibration"))
+    {
+        string calibration_path = var_map["calibration"].as<string>();
+        ofstream os(calibration_path);
+        if (!os)
+        {
+            BOOST_LOG_TRIVIAL(fatal) << "failed to open calibration path at '" << calibration_path << "'. \n Exit !";
+            return -1;
+        }
+        conversion.save(os);
+    }
+    return 0;
+}
+
+int codegen_process(int argc, char *argv[], const string &program_name)
+{
+    string description = PROGRAM_DESCRIPTION + "\n"
+        "Codegen process .\n"
+        "using `" + program_name + " codegen <options>` to write the header of a greedy decoding kernel specialized on the "
+        "dimensions of a trained model , built into `server_aot` by `cmake -DAOT_MODEL_HEADER=<header>` . codegen options are as following";
+    po::options_description op_des = po::options_description(description);
+    op_des.add_options()
+        ("model", po::value<string>(), "Use to specify the model name(path)")
+        ("output", po::value<string>(), "The path to write the generated header")
+        ("help,h", "Show help information.");
+    po::variables_map var_map;
+    po::store(po::command_line_parser(argc, argv).options(op_des).allow_unregistered().run(), var_map);
+    po::notify(var_map);
+    if (var_map.count("help"))
+    {
+        cerr << op_des << endl;
+        return 0;
+    }
+    if (0 == var_map.count("model") || 0 == var_map.count("output"))
+    {
+        BOOST_LOG_TRIVIAL(fatal) << "model and output path should be specified ! \n"
+            "using `" + program_name + " codegen -h ` to see detail parameters .\n"
+            "Exit .";
+        return -1;
+    }
+    string model_path = var_map["model"].as<string>(),
+        output_path = var_map["output"].as<string>();
+
+    // Init 
+    cnn::Initialize(argc, argv, 1234);
+    PoemGeneratorHandler<cnn::SimpleRNNBuilder> pgh;
+    ifstream is(model_path);
+    if (!is)
+    {
+        BOOST_LOG_TRIVIAL(fatal) << "Failed to open model path at '" << model_path << "' . \n"
+            "Exit .";
+        return -1;
+    }
+    is.close();
+    pgh.load_model(model_path);
+
+    ofstream os(output_path);
+    if (!os)
+    {
+        BOOST_LOG_TRIVIAL(fatal) << "failed to open output path at '" << output_path << "'. \n Exit !";
+        return -1;
+    }
+    const PoemGenerator<cnn::SimpleRNNBuilder> &pg = pgh.pg;
+    os << "// generated by `" << program_name << " codegen` from `" << model_path << "` , do not edit\n"
+        "#ifndef AOT_MODEL_H_INCLUDED\n"
+        "#define AOT_MODEL_H_INCLUDED\n"
+        "#include \"aot_kernel.h\"\n\n"
+        "namespace aot_model\n"
+        "{\n"
+        "const unsigned WordEmbeddingDim = " << pg.word_embedding_dim << "U;\n"
+        "const unsigned EncHDim = " << pg.enc_h_dim << "U;\n"
+        "const unsigned EncLayerNum = " << pg.enc_stacked_layer_num << "U;\n"
+        "const unsigned EncHiddenDim = " << pg.enc_hidden_layer_output_dim << "U;\n"
+        "const unsigned DecHDim = " << pg.dec_h_dim << "U;\n"
+        "const unsigned DecLayerNum = " << pg.dec_stacked_layer_num << "U;\n"
+        "template <unsigned SentLen, unsigned SentNum>\n"
+        "using Kernel = AotKernel<WordEmbeddingDim, EncHDim, EncLayerNum, EncHiddenDim, DecHDim, DecLayerNum, SentLen, SentNum>;\n\n"
+        "// the kernels of five and seven character lines , for the line count set on `engine`\n"
+        "inline void set_kernels(InferenceEngine &engine)\n"
+        "{\n"
+        "    set_aot_kernels<WordEmbeddingDim, EncHDim, EncLayerNum, EncHiddenDim, DecHDim, DecLayerNum>(engine);\n"
+        "}\n"
+        "}\n\n"
+        "#endif\n";
+    BOOST_LOG_TRIVIAL(info) << "kernel header written to '" << output_path << "'";
+    return 0;
+}
+
+int convert_process(int argc, char *argv[], const string &program_name)
+{
+    string description = PROGRAM_DESCRIPTION + "\n"
+        "Convert process .\n"
+        "using `" + program_name + " convert <options>` to convert a text model into the binary model format , "
+        "which `generate` and the server map without parsing . convert options are as following";
+    po::options_description op_des = po::options_description(description);
+    op_des.add_options()
+        ("model", po::value<string>(), "Use to specify the model name(path)")
+        ("output", po::value<string>(), "The path to write the binary model")
+        ("help,h", "Show help information.");
+    po::variables_map var_map;
+    po::store(po::command_line_parser(argc, argv).options(op_des).allow_unregistered().run(), var_map);
+    po::notify(var_map);
+    if (var_map.count("help"))
+    {
+        cerr << op_des << endl;
+        return 0;
+    }
+    if (0 == var_map.count("model") || 0 == var_map.count("output"))
+    {
+        BOOST_LOG_TRIVIAL(fatal) << "model and output path should be specified ! \n"
+            "using `" + program_name + " convert -h ` to see detail parameters .\n"
+            "Exit .";
+        return -1;
+    }
+    string model_path = var_map["model"].as<string>(),
+        output_path = var_map["output"].as<string>();
+
+    // Init 
+    cnn::Initialize(argc, argv, 1234);
+    PoemGeneratorHandler<cnn::SimpleRNNBuilder> pgh;
+    ifstream is(model_path);
+    if (!is)
+    {
+        BOOST_LOG_TRIVIAL(fatal) << "Failed to open model path at '" << model_path << "' . \n"
+            "Exit .";
+        return -1;
+    }
+    is.close();
+    pgh.load_model(model_path);
+
+    ofstream os(output_path, ios::binary);
+    if (!os)
+    {
+        BOOST_LOG_TRIVIAL(fatal) << "failed to open output path at '" << output_path << "'. \n Exit !";
+        return -1;
+    }
+    pgh.save_binary_model(os);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     string usage = PROGRAM_DESCRIPTION + "\n"
-        "usage : " + string(argv[0]) + " [ train | generate ] <options> \n"
-        "using  `" + string(argv[0]) + " [ train | generate ] -h` to see details for specify task\n";
+        "usage : " + string(argv[0]) + " [ train | generate | shortlist | quantize | codegen | convert ] <options> \n"
+        "using  `" + string(argv[0]) + " [ train | generate | shortlist | quantize | codegen | convert ] -h` to see details for specify task\n";
     if (argc <= 1)
     {
         cerr << usage;
@@ -161,6 +697,10 @@ int main(int argc, char *argv[])
     }
     else if (string(argv[1]) == "train") return train_process(argc - 1, argv + 1, argv[0]);
     else if (string(argv[1]) == "generate") return generate_process(argc - 1, argv + 1, argv[0]);
+    else if (string(argv[1]) == "shortlist") return shortlist_process(argc - 1, argv + 1, argv[0]);
+    else if (string(argv[1]) == "quantize") return quantize_process(argc - 1, argv + 1, argv[0]);
+    else if (string(argv[1]) == "codegen") return codegen_process(argc - 1, argv + 1, argv[0]);
+    else if (string(argv[1]) == "convert") return convert_process(argc - 1, argv + 1, argv[0]);
     else
     {
         cerr << "unknown mode : " << argv[1] << "\n"
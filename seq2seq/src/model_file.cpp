@@ -0,0 +1,282 @@
+#include "model_file.h"
+
+#include <cassert>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+const char ModelFileMagic[8] = { 'P', 'O', 'E', 'M', 'G', 'E', 'N', '\0' };
+const uint64_t SectionAlign = 64U;
+
+uint64_t align_up(uint64_t offset)
+{
+    return (offset + SectionAlign - 1U) / SectionAlign * SectionAlign;
+}
+
+// true if `size` bytes from `offset` lie within `length` bytes , without overflow
+bool fits(uint64_t offset, uint64_t size, uint64_t length)
+{
+    return offset <= length && size <= length - offset;
+}
+
+void write_padding(ostream &os, uint64_t &offset)
+{
+    static const char zeros[SectionAlign] = { 0 };
+    uint64_t aligned_offset = align_up(offset);
+    os.write(zeros, aligned_offset - offset);
+    offset = aligned_offset;
+}
+
+void write_table(ostream &os, const vector<ModelFileBlock> &blocks, uint64_t &weight_offset)
+{
+    for (const ModelFileBlock &block : blocks)
+    {
+        ModelFileParam param;
+        param.rows = block.rows;
+        param.cols = block.cols;
+        param.offset = weight_offset;
+        os.write(reinterpret_cast<const char*>(&param), sizeof(param));
+        weight_offset = align_up(weight_offset + block.values.size() * sizeof(float));
+    }
+}
+
+void write_blocks(ostream &os, const vector<ModelFileBlock> &blocks, uint64_t &offset)
+{
+    for (const ModelFileBlock &block : blocks)
+    {
+        assert(block.values.size() == static_cast<size_t>(block.rows) * block.cols);
+        os.write(reinterpret_cast<const char*>(block.values.data()), block.values.size() * sizeof(float));
+        offset += block.values.size() * sizeof(float);
+        write_padding(os, offset);
+    }
+}
+}
+
+ModelFileHeader::ModelFileHeader()
+{
+    memset(this, 0, sizeof(*this));
+    memcpy(magic, ModelFileMagic, sizeof(magic));
+    version = ModelFileVersion;
+}
+
+uint64_t vocab_hash(const vector<string> &words)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (const string &word : words)
+    {
+        for (size_t idx = 0; idx <= word.size(); ++idx) // with the terminating zero
+        {
+            hash ^= static_cast<unsigned char>(word.c_str()[idx]);
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+bool is_binary_model_file(const string &path)
+{
+    ifstream is(path, ios::binary);
+    char magic[sizeof(ModelFileMagic)];
+    return is.read(magic, sizeof(magic)) && 0 == memcmp(magic, ModelFileMagic, sizeof(magic));
+}
+
+void write_model_file(ostream &os, ModelFileHeader header, const vector<string> &words,
+    const vector<ModelFileBlock> &params, const vector<ModelFileBlock> &lookup_params)
+{
+    header.word_dict_size = static_cast<uint32_t>(words.size());
+    header.vocab_hash = vocab_hash(words);
+    header.nr_params = static_cast<uint32_t>(params.size());
+    header.nr_lookup_params = static_cast<uint32_t>(lookup_params.size());
+    // offsets first , then every section in order
+    uint64_t words_bytes = 0U;
+    for (const string &word : words) words_bytes += word.size();
+    header.dict_offset = align_up(sizeof(ModelFileHeader));
+    header.table_offset = align_up(header.dict_offset + (words.size() + 1U) * sizeof(uint64_t) + words_bytes);
+    uint64_t weight_offset = align_up(header.table_offset + (params.size() + lookup_params.size()) * sizeof(ModelFileParam));
+    header.file_size = weight_offset;
+    for (const vector<ModelFileBlock> *blocks : { &params, &lookup_params })
+    {
+        for (const ModelFileBlock &block : *blocks) header.file_size = align_up(header.file_size + block.values.size() * sizeof(float));
+    }
+
+    uint64_t offset = 0U;
+    os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    offset += sizeof(header);
+    write_padding(os, offset);
+    uint64_t word_offset = 0U;
+    for (const string &word : words)
+    {
+        os.write(reinterpret_cast<const char*>(&word_offset), sizeof(word_offset));
+        word_offset += word.size();
+    }
+    os.write(reinterpret_cast<const char*>(&word_offset), sizeof(word_offset));
+    for (const string &word : words) os.write(word.data(), word.size());
+    offset += (words.size() + 1U) * sizeof(uint64_t) + words_bytes;
+    write_padding(os, offset);
+    write_table(os, params, weight_offset);
+    write_table(os, lookup_params, weight_offset);
+    offset += (params.size() + lookup_params.size()) * sizeof(ModelFileParam);
+    write_padding(os, offset);
+    write_blocks(os, params, offset);
+    write_blocks(os, lookup_params, offset);
+    assert(offset == header.file_size);
+    if (!os) throw runtime_error("failed to write the binary model");
+}
+
+MappedModelFile::MappedModelFile()
+    :base(nullptr), length(0U)
+{}
+
+MappedModelFile::~MappedModelFile()
+{
+    close();
+}
+
+void MappedModelFile::close()
+{
+#ifndef _WIN32
+    if (base && buffer.empty()) munmap(const_cast<char*>(base), length);
+#endif
+    vector<char>().swap(buffer);
+    base = nullptr;
+    length = 0U;
+}
+
+void MappedModelFile::open(const string &path)
+{
+    close();
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw runtime_error("failed to open binary model at `" + path + "`");
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size < static_cast<off_t>(sizeof(ModelFileHeader)))
+    {
+        ::close(fd);
+        throw runtime_error("binary model at `" + path + "` is truncated");
+    }
+    length = static_cast<size_t>(file_stat.st_size);
+    void *addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (MAP_FAILED == addr)
+    {
+        length = 0U;
+        throw runtime_error("failed to map binary model at `" + path + "`");
+    }
+    base = static_cast<const char*>(addr);
+#else
+    ifstream is(path, ios::binary);
+    if (!is) throw runtime_error("failed to open binary model at `" + path + "`");
+    buffer.assign(istreambuf_iterator<char>(is), istreambuf_iterator<char>());
+    if (buffer.size() < sizeof(ModelFileHeader))
+    {
+        vector<char>().swap(buffer);
+        throw runtime_error("binary model at `" + path + "` is truncated");
+    }
+    base = buffer.data();
+    length = buffer.size();
+#endif
+    const ModelFileHeader &file_header = header();
+    if (0 != memcmp(file_header.magic, ModelFileMagic, sizeof(ModelFileMagic)))
+    {
+        close();
+        throw runtime_error("`" + path + "` is not a binary model");
+    }
+    if (file_header.version != ModelFileVersion)
+    {
+        uint32_t file_version = file_header.version;
+        close();
+        throw runtime_error("binary model version " + to_string(file_version) + " , expected " + to_string(ModelFileVersion));
+    }
+    if (file_header.file_size != length)
+    {
+        close();
+        throw runtime_error("binary model at `" + path + "` is truncated");
+    }
+    string error = layout_error();
+    if (!error.empty())
+    {
+        close();
+        throw runtime_error("binary model at `" + path + "` is corrupted : " + error);
+    }
+    vector<string> file_words;
+    words(file_words);
+    if (vocab_hash(file_words) != file_header.vocab_hash)
+    {
+        close();
+        throw runtime_error("dictionary of binary model at `" + path + "` doesn't match its hash");
+    }
+}
+
+string MappedModelFile::layout_error() const
+{
+    const ModelFileHeader &file_header = header();
+    // the dictionary : its offsets , then the words they point into , in order
+    if (file_header.dict_offset % alignof(uint64_t) != 0U
+        || !fits(file_header.dict_offset, (static_cast<uint64_t>(file_header.word_dict_size) + 1U) * sizeof(uint64_t), length))
+    {
+        return "dictionary offset " + to_string(file_header.dict_offset);
+    }
+    const uint64_t *word_offsets = reinterpret_cast<const uint64_t*>(base + file_header.dict_offset);
+    uint64_t word_bytes_offset = file_header.dict_offset + (static_cast<uint64_t>(file_header.word_dict_size) + 1U) * sizeof(uint64_t);
+    for (size_t word_idx = 0; word_idx < file_header.word_dict_size; ++word_idx)
+    {
+        if (word_offsets[word_idx] > word_offsets[word_idx + 1U]) return "dictionary word " + to_string(word_idx);
+    }
+    if (!fits(word_bytes_offset, word_offsets[file_header.word_dict_size], length)) return "dictionary words";
+    // the table , then every block it points to
+    uint64_t nr_blocks = static_cast<uint64_t>(file_header.nr_params) + file_header.nr_lookup_params;
+    if (file_header.table_offset % alignof(ModelFileParam) != 0U
+        || !fits(file_header.table_offset, nr_blocks * sizeof(ModelFileParam), length))
+    {
+        return "table of " + to_string(nr_blocks) + " blocks at " + to_string(file_header.table_offset);
+    }
+    const ModelFileParam *params = reinterpret_cast<const ModelFileParam*>(base + file_header.table_offset);
+    for (size_t block_idx = 0; block_idx < nr_blocks; ++block_idx)
+    {
+        const ModelFileParam &block = params[block_idx];
+        uint64_t nr_values = static_cast<uint64_t>(block.rows) * block.cols; // can't overflow , both are 32 bits
+        if (block.offset % SectionAlign != 0U || nr_values > length / sizeof(float)
+            || !fits(block.offset, nr_values * sizeof(float), length))
+        {
+            return "weight block " + to_string(block_idx) + " of " + to_string(block.rows) + " x " + to_string(block.cols)
+                + " at " + to_string(block.offset);
+        }
+    }
+    return string();
+}
+
+void MappedModelFile::words(vector<string> &out) const
+{
+    const ModelFileHeader &file_header = header();
+    const uint64_t *word_offsets = reinterpret_cast<const uint64_t*>(base + file_header.dict_offset);
+    const char *word_bytes = reinterpret_cast<const char*>(word_offsets + file_header.word_dict_size + 1U);
+    vector<string> tmp_words(file_header.word_dict_size);
+    for (size_t word_idx = 0; word_idx < tmp_words.size(); ++word_idx)
+    {
+        tmp_words[word_idx].assign(word_bytes + word_offsets[word_idx], word_bytes + word_offsets[word_idx + 1U]);
+    }
+    swap(tmp_words, out);
+}
+
+const ModelFileParam &MappedModelFile::param(size_t idx) const
+{
+    if (idx >= header().nr_params) throw runtime_error("binary model has no parameter " + to_string(idx));
+    return reinterpret_cast<const ModelFileParam*>(base + header().table_offset)[idx];
+}
+
+const ModelFileParam &MappedModelFile::lookup_param(size_t idx) const
+{
+    if (idx >= header().nr_lookup_params) throw runtime_error("binary model has no lookup parameter " + to_string(idx));
+    return reinterpret_cast<const ModelFileParam*>(base + header().table_offset)[header().nr_params + idx];
+}
@@ -0,0 +1,109 @@
+#ifndef MODEL_FILE_H_INCLUDED
+#define MODEL_FILE_H_INCLUDED
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <iostream>
+
+/*
+ * Versioned binary model file , loaded by mapping it read-only : nothing is parsed .
+ * layout , little endian , every section and weight block starts at a 64 bytes boundary :
+ *   header     : magic , version , RNN type , model dimensions , vocabulary hash , section offsets
+ *   dictionary : (word_dict_size + 1) uint64 offsets into the UTF-8 bytes of the words that follow them
+ *   table      : rows , cols and offset of every parameter , in `Model::parameters_list` order ,
+ *                then the lookup parameters in `Model::lookup_parameters_list` order
+ *   weights    : float blocks , row-major {rows , cols} ; a lookup parameter is one row per word
+ * row-major blocks are what the native engine reads , so it points into the mapping instead of copying .
+ */
+
+const std::uint32_t ModelFileVersion = 1U;
+
+enum class ModelFileRNNType : std::uint32_t
+{
+    SimpleRNN = 1U,
+    LSTM = 2U
+};
+
+struct ModelFileHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t rnn_type;
+    std::uint32_t word_embedding_dim;
+    std::uint32_t word_dict_size;
+    std::uint32_t enc_h_dim;
+    std::uint32_t enc_stacked_layer_num;
+    std::uint32_t enc_hidden_layer_output_dim;
+    std::uint32_t enc_output_layer_output_dim;
+    std::uint32_t dec_h_dim;
+    std::uint32_t dec_stacked_layer_num;
+    std::uint64_t vocab_hash;
+    std::uint32_t nr_params;
+    std::uint32_t nr_lookup_params;
+    std::uint64_t dict_offset;
+    std::uint64_t table_offset;
+    std::uint64_t file_size;
+
+    ModelFileHeader();
+};
+
+struct ModelFileParam
+{
+    std::uint32_t rows;
+    std::uint32_t cols;
+    std::uint64_t offset;
+};
+
+// a parameter to write , row-major
+struct ModelFileBlock
+{
+    std::uint32_t rows;
+    std::uint32_t cols;
+    std::vector<float> values;
+};
+
+// FNV-1a over the words , each followed by a zero byte
+std::uint64_t vocab_hash(const std::vector<std::string> &words);
+// true if the file at `path` starts with the magic of a binary model
+bool is_binary_model_file(const std::string &path);
+// `header` gives the dimensions and the RNN type , counts , offsets and the hash are filled in
+void write_model_file(std::ostream &os, ModelFileHeader header, const std::vector<std::string> &words,
+    const std::vector<ModelFileBlock> &params, const std::vector<ModelFileBlock> &lookup_params);
+
+class MappedModelFile
+{
+public:
+    MappedModelFile();
+    ~MappedModelFile();
+    MappedModelFile(const MappedModelFile&) = delete;
+    MappedModelFile &operator=(const MappedModelFile&) = delete;
+
+    // throws std::runtime_error if the file is missing , truncated , of another version , its dictionary is corrupted
+    // or a section or weight block lies outside of it
+    void open(const std::string &path);
+
+    const ModelFileHeader &header() const { return *reinterpret_cast<const ModelFileHeader*>(base); }
+    void words(std::vector<std::string> &out) const;
+    const ModelFileParam &param(std::size_t idx) const;
+    const ModelFileParam &lookup_param(std::size_t idx) const;
+    const float *values(const ModelFileParam &param) const
+    {
+        return reinterpret_cast<const float*>(base + param.offset);
+    }
+    std::size_t size() const { return length; }
+    bool contains(const void *p) const
+    {
+        return base && static_cast<const char*>(p) >= base && static_cast<const char*>(p) < base + length;
+    }
+
+private:
+    const char *base;
+    std::size_t length;
+    std::vector<char> buffer; // the whole file , where it can't be mapped
+
+    void close();
+    // what is wrong with the section offsets , the dictionary offsets or the weight blocks , empty if nothing
+    std::string layout_error() const;
+};
+
+#endif
@@ -17,6 +17,7 @@
 #include <boost/log/trivial.hpp>
 
 #include "layers.h"
+#include "selection.h"
 #include "typedec.h"
 
 template <typename RNNType>
@@ -61,7 +62,24 @@ struct PoemGenerator
     void print_model_info();
 
     cnn::expr::Expression build_graph(cnn::ComputationGraph &cg , const Poem &poem);
-    void generate(cnn::ComputationGraph &cg, const IndexSeq &first_seq, Poem &generated_poem);
+    // the same loss graph with its lookups and losses reading `words` , which must outlive the graph .
+    // rewriting `words` with another poem of the same shape and running forward again replays it
+    cnn::expr::Expression build_replayable_graph(cnn::ComputationGraph &cg , const std::vector<std::vector<unsigned>> &words);
+    void generate(cnn::ComputationGraph &cg, const IndexSeq &first_seq, Poem &generated_poem, std::size_t sent_num = PoemSentNum);
+    // greedy generation graph of `words.size()` lines : the first line is read from `words[0]` , every other lookup
+    // reads the word predicted into `words` ; `dist_nodes[line - 1][pos]` is the output of a step
+    void build_generation_graph(cnn::ComputationGraph &cg, const std::vector<std::vector<unsigned>> &words,
+        std::vector<std::vector<cnn::VariableIndex>> &dist_nodes);
+    // (re)run a generation graph for `first_seq` , step by step
+    void run_generation_graph(cnn::ComputationGraph &cg, std::vector<std::vector<unsigned>> &words,
+        const std::vector<std::vector<cnn::VariableIndex>> &dist_nodes, const IndexSeq &first_seq, Poem &generated_poem);
+
+    void new_graph(cnn::ComputationGraph &cg);
+    // encode one line , push its output to the history and start the decoder from the history
+    void encode_and_start_decoder(const std::vector<cnn::expr::Expression> &X, std::deque<cnn::expr::Expression> &history_outputs);
+    // `word_at(sent_idx , word_idx)` gives an index , or a pointer to it
+    template <typename WordAt>
+    cnn::expr::Expression build_loss_graph(cnn::ComputationGraph &cg, const std::vector<std::size_t> &sent_lens, WordAt word_at);
 };
 
 template <typename RNNType>
@@ -125,67 +143,80 @@ void PoemGenerator<RNNType>::print_model_info()
 }
 
 template <typename RNNType>
-Expression PoemGenerator<RNNType>::build_graph(cnn::ComputationGraph &cg , const Poem &poem)
+void PoemGenerator<RNNType>::new_graph(cnn::ComputationGraph &cg)
 {
     bi_enc->new_graph(cg);
     dec->new_graph(cg);
     enc_hidden_layer->new_graph(cg);
     enc_output_layer->new_graph(cg);
     dec_output_layer->new_graph(cg);
+}
+
+template <typename RNNType>
+void PoemGenerator<RNNType>::encode_and_start_decoder(const std::vector<cnn::expr::Expression> &X,
+    std::deque<cnn::expr::Expression> &history_outputs)
+{
+    // BILSTM encode layer
+    bi_enc->start_new_sequence();
+    bi_enc->build_graph(X);
+
+    // enc hidden layer
+    std::vector<cnn::expr::Expression> final_h_cont;
+    bi_enc->get_final_h(final_h_cont); // 2 * enc_stacked_layer_num , every is {enc_h_dim , 1}
+    cnn::expr::Expression h_combined_exp = concatenate(final_h_cont); // {enc_h_dim * 2 * enc_stacked_layer_num , 1}
+    cnn::expr::Expression enc_hidden_layer_output_exp = enc_hidden_layer->build_graph(h_combined_exp);
+    enc_hidden_layer_output_exp = rectify(enc_hidden_layer_output_exp); // rectify
+
+    history_outputs.push_front(enc_hidden_layer_output_exp);
+
+    // enc output layer
+    std::size_t cur_history_size = history_outputs.size() ;
+    history_outputs.resize( std::min( MaxHistoryLen, cur_history_size) ); // truncate the first MaxHistoyrLen
+    cnn::expr::Expression enc_output_layer_output_exp = enc_output_layer->build_graph(std::vector<Expression>(
+        history_outputs.begin(), history_outputs.end()));
+
+    // split output exp to init the decoder . For RNN or GRU , only h is to be initilized
+    std::vector<cnn::expr::Expression> init_for_dec_combine(dec_stacked_layer_num);
+    for (std::size_t layer_idx = 0; layer_idx < dec_stacked_layer_num; ++layer_idx)
+    {
+        cnn::expr::Expression splited_exp = pickrange(enc_output_layer_output_exp,
+            layer_idx * dec_h_dim, (layer_idx + 1)*dec_h_dim);
+        init_for_dec_combine[layer_idx] = cnn::expr::tanh(splited_exp);
+    }
+    dec->start_new_sequence(init_for_dec_combine);
+}
+
+template <typename RNNType>
+template <typename WordAt>
+Expression PoemGenerator<RNNType>::build_loss_graph(cnn::ComputationGraph &cg, const std::vector<std::size_t> &sent_lens,
+    WordAt word_at)
+{
+    new_graph(cg);
     
     cnn::expr::Expression DEC_SOS_exp = parameter(cg, DEC_SOS_param);
     std::vector<cnn::expr::Expression> loss_cont;
     std::deque<cnn::expr::Expression> enc_hidden_layer_output_cont ;
-    for (std::size_t generating_idx = 1; generating_idx < poem.size(); ++generating_idx)
+    for (std::size_t generating_idx = 1; generating_idx < sent_lens.size(); ++generating_idx)
     {
-        const IndexSeq &cur_seq = poem.at(generating_idx-1),
-            &gen_seq = poem.at(generating_idx);
-        std::vector<cnn::expr::Expression> X(cur_seq.size());
-        for (size_t word_idx = 0; word_idx < cur_seq.size(); ++word_idx)
+        std::size_t cur_len = sent_lens.at(generating_idx - 1),
+            gen_len = sent_lens.at(generating_idx);
+        std::vector<cnn::expr::Expression> X(cur_len);
+        for (size_t word_idx = 0; word_idx < cur_len; ++word_idx)
         {
-            X[word_idx] = lookup(cg, words_lookup_param, cur_seq.at(word_idx));
+            X[word_idx] = lookup(cg, words_lookup_param, word_at(generating_idx - 1, word_idx));
         }
-
-        // BILSTM encode layer
-        bi_enc->start_new_sequence();
-        bi_enc->build_graph(X);
-        
-        // enc hidden layer
-        std::vector<cnn::expr::Expression> final_h_cont;
-        bi_enc->get_final_h(final_h_cont); // 2 * enc_stacked_layer_num , every is {enc_h_dim , 1}
-        cnn::expr::Expression h_combined_exp = concatenate(final_h_cont); // {enc_h_dim * 2 * enc_stacked_layer_num , 1}
-        cnn::expr::Expression enc_hidden_layer_output_exp = enc_hidden_layer->build_graph(h_combined_exp);
-        cg.incremental_forward(); // do as example 
-        enc_hidden_layer_output_exp = rectify(enc_hidden_layer_output_exp); // rectify
-
-        enc_hidden_layer_output_cont.push_front(enc_hidden_layer_output_exp);
-        
-        // enc output layer
-        std::size_t cur_history_size = enc_hidden_layer_output_cont.size() ;
-        enc_hidden_layer_output_cont.resize( std::min( MaxHistoryLen, cur_history_size) ); // truncate the first MaxHistoyrLen
-        cnn::expr::Expression enc_output_layer_output_exp = enc_output_layer->build_graph(std::vector<Expression>(
-            enc_hidden_layer_output_cont.begin(), enc_hidden_layer_output_cont.end()));
-
-        // split output exp to init the decoder
-        std::vector<cnn::expr::Expression> init_for_dec_combine(dec_stacked_layer_num);
-        for (std::size_t layer_idx = 0; layer_idx < dec_stacked_layer_num; ++layer_idx)
-        {
-            cnn::expr::Expression splited_exp = pickrange(enc_output_layer_output_exp,
-                layer_idx * dec_h_dim, (layer_idx + 1)*dec_h_dim);
-            init_for_dec_combine[layer_idx] = cnn::expr::tanh(splited_exp);
-        }
-        dec->start_new_sequence(init_for_dec_combine);
+        encode_and_start_decoder(X, enc_hidden_layer_output_cont);
 
         // output
         cnn::expr::Expression pre_word_exp = DEC_SOS_exp;
-        for (size_t word_idx = 0; word_idx < gen_seq.size(); ++word_idx)
+        for (size_t word_idx = 0; word_idx < gen_len; ++word_idx)
         {
             // to generate `word_idx` word
             cnn::expr::Expression dec_out_exp = dec->add_input(pre_word_exp);
             cnn::expr::Expression dec_output_layer_output_exp = dec_output_layer->build_graph(dec_out_exp);
-            cnn::expr::Expression loss = pickneglogsoftmax(dec_output_layer_output_exp , gen_seq.at(word_idx));
+            cnn::expr::Expression loss = pickneglogsoftmax(dec_output_layer_output_exp , word_at(generating_idx, word_idx));
             loss_cont.push_back(loss);
-            pre_word_exp = lookup(cg, words_lookup_param, gen_seq.at(word_idx)); // for next circulation
+            pre_word_exp = lookup(cg, words_lookup_param, word_at(generating_idx, word_idx)); // for next circulation
         }
             // processing EOS
             // here pre_word_exp is the last word exp
@@ -200,86 +231,101 @@ Expression PoemGenerator<RNNType>::build_graph(cnn::ComputationGraph &cg , const
 }
 
 template <typename RNNType>
-void PoemGenerator<RNNType>::generate(cnn::ComputationGraph &cg, const IndexSeq &first_seq, Poem &generated_poem)
+Expression PoemGenerator<RNNType>::build_graph(cnn::ComputationGraph &cg , const Poem &poem)
 {
-    size_t poem_sent_len = first_seq.size();
-    
-    bi_enc->new_graph(cg);
-    enc_hidden_layer->new_graph(cg);
-    enc_output_layer->new_graph(cg);
-    dec->new_graph(cg);
-    dec_output_layer->new_graph(cg);
+    std::vector<std::size_t> sent_lens;
+    for (const IndexSeq &sent : poem) sent_lens.push_back(sent.size());
+    return build_loss_graph(cg, sent_lens, [&poem](std::size_t sent_idx, std::size_t word_idx)
+    {
+        return static_cast<unsigned>(poem[sent_idx][word_idx]);
+    });
+}
+
+template <typename RNNType>
+Expression PoemGenerator<RNNType>::build_replayable_graph(cnn::ComputationGraph &cg ,
+    const std::vector<std::vector<unsigned>> &words)
+{
+    std::vector<std::size_t> sent_lens;
+    for (const std::vector<unsigned> &sent : words) sent_lens.push_back(sent.size());
+    return build_loss_graph(cg, sent_lens, [&words](std::size_t sent_idx, std::size_t word_idx)
+    {
+        return &words[sent_idx][word_idx];
+    });
+}
+
+template <typename RNNType>
+void PoemGenerator<RNNType>::build_generation_graph(cnn::ComputationGraph &cg, const std::vector<std::vector<unsigned>> &words,
+    std::vector<std::vector<cnn::VariableIndex>> &dist_nodes)
+{
+    new_graph(cg);
 
     cnn::expr::Expression DEC_SOS_exp = parameter(cg, DEC_SOS_param);
     std::deque<cnn::expr::Expression> history_outputs;
-    std::vector<IndexSeq> tmp_poem(PoemSentNum, IndexSeq(poem_sent_len));
-    std::copy(first_seq.cbegin(), first_seq.cend(), tmp_poem[0].begin());
-    std::set<Index> has_generated_set ;
-    for (unsigned generating_idx = 1; generating_idx < PoemSentNum; ++generating_idx)
+    std::vector<std::vector<cnn::VariableIndex>> tmp_dist_nodes;
+    for (std::size_t generating_idx = 1; generating_idx < words.size(); ++generating_idx)
     {
-        IndexSeq &cur_seq = tmp_poem.at(generating_idx - 1),
-            &gen_seq = tmp_poem.at(generating_idx);
+        const std::vector<unsigned> &cur_seq = words.at(generating_idx - 1),
+            &gen_seq = words.at(generating_idx);
         // ready input for encoder
-        std::vector<cnn::expr::Expression> X(poem_sent_len);
-        for (std::size_t word_idx = 0; word_idx < poem_sent_len; ++word_idx)
+        std::vector<cnn::expr::Expression> X(cur_seq.size());
+        for (std::size_t word_idx = 0; word_idx < cur_seq.size(); ++word_idx)
         {
-            X[word_idx] = lookup(cg, words_lookup_param, cur_seq.at(word_idx));
+            X[word_idx] = lookup(cg, words_lookup_param, &cur_seq[word_idx]);
         }
+        encode_and_start_decoder(X, history_outputs);
 
-        // bilstm encoder
-        bi_enc->start_new_sequence();
-        bi_enc->build_graph(X);
-
-        // encoder hidden layer
-        std::vector<Expression> final_h_cont;
-        bi_enc->get_final_h(final_h_cont);
-        cnn::expr::Expression h_combined = concatenate(final_h_cont);
-        cnn::expr::Expression enc_hidden_layer_output = enc_hidden_layer->build_graph(h_combined);
-        enc_hidden_layer_output = rectify(enc_hidden_layer_output);
-        
-        // encoder output layer
-        history_outputs.push_front(enc_hidden_layer_output);
-        size_t cur_history_size = history_outputs.size() ;
-        history_outputs.resize(std::min(MaxHistoryLen, cur_history_size));
-        cnn::expr::Expression enc_output_layer_output = enc_output_layer->build_graph(std::vector<Expression>(history_outputs.begin(), history_outputs.end()));
-
-        // decoder
-        //std::vector<Expression> splited_exp_cont(dec_stacked_layer_num * 2); For RNN or GRU , only h is to be initilized
-        std::vector<Expression> splited_exp_cont(dec_stacked_layer_num );
-        for (size_t layer_idx = 0; layer_idx < dec_stacked_layer_num; ++layer_idx)
-        {
-            cnn::expr::Expression init_for_c = pickrange(enc_output_layer_output, layer_idx * dec_h_dim,
-                (layer_idx + 1) * dec_h_dim);
-            splited_exp_cont[layer_idx] = cnn::expr::tanh(init_for_c);
-        }
-        dec->start_new_sequence(splited_exp_cont);
-        cg.incremental_forward();
+        // decoder : every step looks up the word predicted by the previous one
+        tmp_dist_nodes.push_back(std::vector<cnn::VariableIndex>());
         cnn::expr::Expression pre_word_exp = DEC_SOS_exp;
-        for (size_t gen_idx = 0; gen_idx < poem_sent_len; ++gen_idx)
+        for (std::size_t gen_idx = 0; gen_idx < gen_seq.size(); ++gen_idx)
         {
             cnn::expr::Expression dec_out_exp = dec->add_input(pre_word_exp);
-            dec_output_layer->build_graph(dec_out_exp); 
-            std::vector<cnn::real> dist = as_vector(cg.incremental_forward());
+            tmp_dist_nodes.back().push_back(dec_output_layer->build_graph(dec_out_exp).i);
+            if (gen_idx + 1 < gen_seq.size()) pre_word_exp = lookup(cg, words_lookup_param, &gen_seq[gen_idx]);
+        }
+    }
+    swap(tmp_dist_nodes, dist_nodes);
+}
+
+template <typename RNNType>
+void PoemGenerator<RNNType>::run_generation_graph(cnn::ComputationGraph &cg, std::vector<std::vector<unsigned>> &words,
+    const std::vector<std::vector<cnn::VariableIndex>> &dist_nodes, const IndexSeq &first_seq, Poem &generated_poem)
+{
+    std::copy(first_seq.cbegin(), first_seq.cend(), words.at(0).begin());
+    cg.invalidate();
+    ExclusionBitmap has_generated_bitmap(word_dict_size);
+    for (std::size_t generating_idx = 1; generating_idx < words.size(); ++generating_idx)
+    {
+        std::vector<unsigned> &gen_seq = words.at(generating_idx);
+        for (std::size_t gen_idx = 0; gen_idx < gen_seq.size(); ++gen_idx)
+        {
+            // only up to this step : the next lookup reads the word written below
+            const cnn::Tensor &dist = cg.ee->incremental_forward(dist_nodes[generating_idx - 1][gen_idx]); // select in place , no copy of the distribution
             //Index predicted_word_idx = distance(dist.cbegin(), max_element(dist.cbegin(), dist.cend()));
             // just get the Highest score will cause to repeat ! 
             // we'll add the rule that the next words will never occures in the previous
-            Index predicted_word_idx = -1 ;
-            cnn::real max_score_conditioned = -1. ; // scores are all negative
-            for(std::size_t idx = 0 ; idx < dist.size() ; ++idx)
-            {
-                if(dist.at(idx) > max_score_conditioned && has_generated_set.find(idx) == has_generated_set.end())
-                {
-                    predicted_word_idx = idx ;
-                    max_score_conditioned = dist.at(idx) ;
-                }
-            } 
+            Index predicted_word_idx = masked_argmax(dist.v, dist.d.size(), has_generated_bitmap) ;
             assert(predicted_word_idx != -1) ;
-            has_generated_set.insert(predicted_word_idx) ;
-            gen_seq[gen_idx] = predicted_word_idx;
-            pre_word_exp = lookup(cg, words_lookup_param, predicted_word_idx);
+            has_generated_bitmap.set(predicted_word_idx) ;
+            gen_seq[gen_idx] = static_cast<unsigned>(predicted_word_idx);
         }
     }
+    Poem tmp_poem(words.size());
+    for (std::size_t sent_idx = 0; sent_idx < words.size(); ++sent_idx)
+    {
+        tmp_poem[sent_idx].assign(words[sent_idx].cbegin(), words[sent_idx].cend());
+    }
     swap(tmp_poem, generated_poem);
 }
 
+template <typename RNNType>
+void PoemGenerator<RNNType>::generate(cnn::ComputationGraph &cg, const IndexSeq &first_seq, Poem &generated_poem,
+    std::size_t sent_num)
+{
+    std::vector<std::vector<unsigned>> words(sent_num, std::vector<unsigned>(first_seq.size()));
+    std::vector<std::vector<cnn::VariableIndex>> dist_nodes;
+    build_generation_graph(cg, words, dist_nodes);
+    run_generation_graph(cg, words, dist_nodes, first_seq, generated_poem);
+}
+
 #endif
@@ -1,6 +1,7 @@
 #ifndef POEM_GENERATE_HANDLER_H_INCLUDED
 #define POEM_GENERATE_HANDLER_H_INCLUDED
 #include <random>
+#include <mutex>
 #include <fstream>
 #include <boost/log/trivial.hpp>
 #include <boost/log/core.hpp>
@@ -11,14 +12,40 @@
 #include <boost/program_options.hpp>
 
 #include "poem_generate.h"
+#include "graph_replay.h"
+#include "inference_engine.h"
+#include "model_file.h"
 #include "timestat.hpp"
 #include "thirdparty/utf8.h"
 
 
+// RNN type recorded in binary models
+template <typename RNNType>
+struct ModelFileRNNTypeOf;
+template <>
+struct ModelFileRNNTypeOf<cnn::SimpleRNNBuilder> { static const ModelFileRNNType value = ModelFileRNNType::SimpleRNN; };
+template <>
+struct ModelFileRNNTypeOf<cnn::LSTMBuilder> { static const ModelFileRNNType value = ModelFileRNNType::LSTM; };
+
+/*
+ * once the model is loaded and configured , `generate` and `generate_n_best` may be called from many threads .
+ * the native engine is the immutable , shared part : every call keeps its decoding states on its own stack ,
+ * so calls run concurrently . the graph path can't : cnn allocates every computation graph from process-wide
+ * memory pools , one graph at a time , and the builders and layers of `pg` hold the expressions of that graph ,
+ * so graph calls take turns on `graph_mtx` .
+ */
 template <typename RNNType>
 struct PoemGeneratorHandler
 {
     PoemGenerator<RNNType> pg;
+    InferenceEngine engine; // graph-free path , enabled by `enable_native_engine`
+    bool use_native_engine;
+    bool use_graph_replay; // graph path : replay one graph per poem shape , enabled by `enable_graph_replay`
+    std::unique_ptr<GenerateGraphReplay<RNNType>> generate_replay;
+    std::mutex graph_mtx; // held by a generation on the graph path
+    std::size_t poem_sent_num; // lines of a generated poem , set by `set_poem_sent_num`
+    std::shared_ptr<const MappedModelFile> mapped_model; // the binary model loaded , if any
+    bool inference_only; // loaded by `load_inference_model` : no cnn model , the native engine only
     std::mt19937 rng;
     PoemGeneratorHandler(size_t seed=1314);
     ~PoemGeneratorHandler();
@@ -31,13 +58,36 @@ struct PoemGeneratorHandler
     void build_model();
 
     void train(const std::vector<Poem> &poems , size_t max_epoch , size_t report_freq=1000);
-    void generate(const std::string &first_seq, std::vector<std::string> &generated_poem);
+    // `generate` and `generate_n_best` return true if the beam was narrowed for `opts.deadline` (see `InferenceEngine`)
+    bool generate(const std::string &first_seq, std::vector<std::string> &generated_poem,
+        const DecodeOptions &opts = DecodeOptions());
+    // several candidates with their log probabilities , the native engine only ; the graph path gives one poem and NaN
+    bool generate_n_best(const std::string &first_seq, std::size_t n, std::vector<std::vector<std::string>> &generated_poems,
+        std::vector<float> &log_probs, const DecodeOptions &opts = DecodeOptions());
 
     void save_model(std::ofstream &os);
     void load_model(std::ifstream &is);
+    // binary model (see model_file.h) ; `load_model` by path takes either format
+    void save_binary_model(std::ofstream &os);
+    void load_binary_model(const std::string &model_path);
+    void load_model(const std::string &model_path);
+    // serving load for the native engine : the weights of a binary model stay in its mapping and no cnn model is built ,
+    // so there are no gradients nor training memory pools , and the graph path is unavailable .
+    // a text model can only be read into a cnn model , it is loaded fully
+    void load_inference_model(const std::string &model_path);
+    // bytes of the cnn model (values , gradients) and of the native engine weights per parameter group
+    void log_memory_usage();
+    void enable_native_engine();
+    void enable_graph_replay();
+    void set_poem_sent_num(std::size_t sent_num);
+    void load_shortlist(std::ifstream &is);
 
     // tools 
     void slice_utf8_sents2single_words(const std::string &usent, std::vector<std::string> &words_cont);
+    void first_seq2index_seq(const std::string &first_seq, IndexSeq &first_index_seq);
+    void poem2sents(const Poem &poem, std::vector<std::string> &generated_poem);
+    // dimensions and dictionary of a binary model
+    void read_binary_model_header(const MappedModelFile &mapped);
 };
 
 
@@ -45,7 +95,8 @@ struct PoemGeneratorHandler
 
 template <typename RNNType>
 PoemGeneratorHandler<RNNType>::PoemGeneratorHandler(std::size_t seed)
-    :pg(PoemGenerator<RNNType>()) , rng(seed)
+    :pg(PoemGenerator<RNNType>()) , use_native_engine(false) , use_graph_replay(false) ,
+    poem_sent_num(PoemGenerator<RNNType>::PoemSentNum) , inference_only(false) , rng(seed)
 {}
 
 template <typename RNNType>
@@ -137,20 +188,34 @@ void PoemGeneratorHandler<RNNType>::train(const std::vector<Poem> &poems , std::
     for (std::size_t idx = 0; idx < poems_size; ++idx) access_order[idx] = idx;
     cnn::MomentumSGDTrainer sgd(pg.m);
     std::size_t training_cnt = 0 ;
+    // poems of one shape are trained in runs , so the graph is rebuilt about once per run
+    const std::size_t ReplayRunLen = 64U;
+    generate_replay.reset(); // one graph at a time
+    std::unique_ptr<LossGraphReplay<RNNType>> loss_replay;
+    if (use_graph_replay) loss_replay.reset(new LossGraphReplay<RNNType>(pg));
     for (std::size_t nr_epoch = 0; nr_epoch < max_epoch; ++nr_epoch)
     {
         BOOST_LOG_TRIVIAL(info) << "--------- " << nr_epoch + 1 << "/" << max_epoch << " ---------";
         shuffle(access_order.begin(), access_order.end(), rng);
+        if (loss_replay) group_runs_by_shape(poems, access_order, ReplayRunLen);
         TimeStat stat;
         stat.start_time_stat();
         for (std::size_t idx = 0; idx < poems_size; ++idx)
         {
             std::size_t access_idx = access_order.at(idx);
             const Poem &poem = poems.at(access_idx);
-            cnn::ComputationGraph cg;
-            pg.build_graph(cg, poem);
-            stat.loss += as_scalar(cg.forward());
-            cg.backward();
+            if (loss_replay)
+            {
+                stat.loss += loss_replay->forward(poem);
+                loss_replay->backward();
+            }
+            else
+            {
+                cnn::ComputationGraph cg;
+                pg.build_graph(cg, poem);
+                stat.loss += as_scalar(cg.forward());
+                cg.backward();
+            }
             sgd.update(1.f);
             ++training_cnt ;
             if(0 == training_cnt % report_freq) 
@@ -164,28 +229,96 @@ void PoemGeneratorHandler<RNNType>::train(const std::vector<Poem> &poems , std::
         BOOST_LOG_TRIVIAL(info) << "---------- " << nr_epoch + 1 << " epoch end --------\n"
             << "Time cost " << stat.get_time_cost_in_seconds() << " s\n"
             << "sum E = " << stat.get_sum_E();
+        if (loss_replay)
+        {
+            BOOST_LOG_TRIVIAL(info) << "graph built " << loss_replay->get_build_cnt() << " times , replayed "
+                << loss_replay->get_replay_cnt() << " times";
+        }
     }
     BOOST_LOG_TRIVIAL(info) << "training done ." ;
 }
 
 template <typename RNNType>
-void PoemGeneratorHandler<RNNType>::generate(const std::string &first_seq, std::vector<std::string> &generated_poem)
+bool PoemGeneratorHandler<RNNType>::generate(const std::string &first_seq, std::vector<std::string> &generated_poem,
+    const DecodeOptions &opts)
 {
-    cnn::ComputationGraph cg;
     IndexSeq first_index_seq;
     Poem poem;
+    bool is_narrowed = false;
+    first_seq2index_seq(first_seq, first_index_seq);
+    if (use_native_engine) is_narrowed = engine.generate(first_index_seq, poem, opts);
+    else
+    {
+        if (opts.beam_width > 1U || opts.is_sampling())
+        {
+            BOOST_LOG_TRIVIAL(warning) << "beam search and sampling need the native engine , decode greedily instead .";
+        }
+        std::lock_guard<std::mutex> lock(graph_mtx);
+        if (use_graph_replay)
+        {
+            if (!generate_replay) generate_replay.reset(new GenerateGraphReplay<RNNType>(pg));
+            generate_replay->generate(first_index_seq, poem, poem_sent_num);
+        }
+        else
+        {
+            cnn::ComputationGraph cg;
+            pg.generate(cg, first_index_seq, poem, poem_sent_num);
+        }
+    }
+    poem2sents(poem, generated_poem);
+    return is_narrowed;
+}
 
-    // trans first_seq to indexSeq
+template <typename RNNType>
+bool PoemGeneratorHandler<RNNType>::generate_n_best(const std::string &first_seq, std::size_t n,
+    std::vector<std::vector<std::string>> &generated_poems, std::vector<float> &log_probs, const DecodeOptions &opts)
+{
+    std::vector<std::vector<std::string>> tmp_poems;
+    std::vector<float> tmp_log_probs;
+    bool is_narrowed = false;
+    if (use_native_engine)
+    {
+        IndexSeq first_index_seq;
+        std::vector<ScoredPoem> scored_poems;
+        first_seq2index_seq(first_seq, first_index_seq);
+        is_narrowed = engine.generate_n_best(first_index_seq, n, scored_poems, opts);
+        for (const ScoredPoem &scored_poem : scored_poems)
+        {
+            tmp_poems.push_back(std::vector<std::string>());
+            poem2sents(scored_poem.poem, tmp_poems.back());
+            tmp_log_probs.push_back(scored_poem.log_prob);
+        }
+    }
+    else
+    {
+        if (n > 1U) BOOST_LOG_TRIVIAL(warning) << "n-best generation needs the native engine , generate one poem instead .";
+        tmp_poems.push_back(std::vector<std::string>());
+        generate(first_seq, tmp_poems.back(), opts);
+        tmp_log_probs.push_back(std::numeric_limits<float>::quiet_NaN());
+    }
+    swap(tmp_poems, generated_poems);
+    swap(tmp_log_probs, log_probs);
+    return is_narrowed;
+}
+
+template <typename RNNType>
+void PoemGeneratorHandler<RNNType>::first_seq2index_seq(const std::string &first_seq, IndexSeq &first_index_seq)
+{
     std::vector<std::string> words_cont;
     slice_utf8_sents2single_words(first_seq, words_cont);
+    IndexSeq tmp_first_index_seq;
     for (std::string &word : words_cont)
     {
-        first_index_seq.push_back(pg.word_dict.Convert(word));
+        tmp_first_index_seq.push_back(pg.word_dict.Convert(word));
     }
-    pg.generate(cg , first_index_seq, poem);
-    // trans Poem to std::vector of sents 
+    swap(tmp_first_index_seq, first_index_seq);
+}
+
+template <typename RNNType>
+void PoemGeneratorHandler<RNNType>::poem2sents(const Poem &poem, std::vector<std::string> &generated_poem)
+{
     std::vector<std::string> tmp_generated_poem;
-    for (IndexSeq &index_seq : poem)
+    for (const IndexSeq &index_seq : poem)
     {
         std::string tmp_line = "";
         for (Index word_lookup_idx : index_seq)
@@ -229,6 +362,203 @@ void PoemGeneratorHandler<RNNType>::load_model(std::ifstream &is)
     BOOST_LOG_TRIVIAL(info) << "loaded ." ;
 }
 
+template <typename RNNType>
+void PoemGeneratorHandler<RNNType>::save_binary_model(std::ofstream &os)
+{
+    BOOST_LOG_TRIVIAL(info) << "saving binary model ..." ;
+    ModelFileHeader header;
+    header.rnn_type = static_cast<std::uint32_t>(ModelFileRNNTypeOf<RNNType>::value);
+    header.word_embedding_dim = pg.word_embedding_dim;
+    header.enc_h_dim = pg.enc_h_dim;
+    header.enc_stacked_layer_num = pg.enc_stacked_layer_num;
+    header.enc_hidden_layer_output_dim = pg.enc_hidden_layer_output_dim;
+    header.enc_output_layer_output_dim = pg.enc_output_layer_output_dim;
+    header.dec_h_dim = pg.dec_h_dim;
+    header.dec_stacked_layer_num = pg.dec_stacked_layer_num;
+    std::vector<std::string> words(pg.word_dict.size());
+    for (std::size_t word_idx = 0; word_idx < words.size(); ++word_idx) words[word_idx] = pg.word_dict.Convert(word_idx);
+    // cnn tensors are column-major , the file is row-major
+    std::vector<ModelFileBlock> params;
+    for (const cnn::Parameters *p : pg.m->parameters_list())
+    {
+        ModelFileBlock block;
+        block.rows = p->values.d.rows();
+        block.cols = p->values.d.size() / block.rows;
+        block.values.resize(static_cast<std::size_t>(block.rows) * block.cols);
+        for (unsigned r = 0; r < block.rows; ++r)
+        {
+            for (unsigned c = 0; c < block.cols; ++c) block.values[r * block.cols + c] = p->values.v[c * block.rows + r];
+        }
+        params.push_back(std::move(block));
+    }
+    std::vector<ModelFileBlock> lookup_params;
+    for (const cnn::LookupParameters *lp : pg.m->lookup_parameters_list())
+    {
+        ModelFileBlock block;
+        block.rows = lp->values.size();
+        block.cols = lp->values.empty() ? 0U : lp->values[0].d.size();
+        for (const cnn::Tensor &t : lp->values) block.values.insert(block.values.end(), t.v, t.v + block.cols);
+        lookup_params.push_back(std::move(block));
+    }
+    write_model_file(os, header, words, params, lookup_params);
+    BOOST_LOG_TRIVIAL(info) << "saved ." ;
+}
+
+template <typename RNNType>
+void PoemGeneratorHandler<RNNType>::load_binary_model(const std::string &model_path)
+{
+    BOOST_LOG_TRIVIAL(info) << "mapping binary model ..." ;
+    std::shared_ptr<MappedModelFile> tmp_mapped(new MappedModelFile());
+    tmp_mapped->open(model_path);
+    read_binary_model_header(*tmp_mapped);
+    const ModelFileHeader &header = tmp_mapped->header();
+    build_model();
+    const std::vector<cnn::Parameters*> &params_list = pg.m->parameters_list();
+    const std::vector<cnn::LookupParameters*> &lookup_params_list = pg.m->lookup_parameters_list();
+    if (header.nr_params != params_list.size() || header.nr_lookup_params != lookup_params_list.size())
+    {
+        throw std::runtime_error("binary model doesn't match the model parameters");
+    }
+    for (std::size_t param_idx = 0; param_idx < params_list.size(); ++param_idx)
+    {
+        cnn::Parameters *p = params_list[param_idx];
+        const ModelFileParam &block = tmp_mapped->param(param_idx);
+        unsigned rows = p->values.d.rows(),
+            cols = p->values.d.size() / rows;
+        if (block.rows != rows || block.cols != cols) throw std::runtime_error("binary model parameter of another shape");
+        const float *values = tmp_mapped->values(block);
+        for (unsigned r = 0; r < rows; ++r)
+        {
+            for (unsigned c = 0; c < cols; ++c) p->values.v[c * rows + r] = values[r * cols + c];
+        }
+    }
+    for (std::size_t param_idx = 0; param_idx < lookup_params_list.size(); ++param_idx)
+    {
+        cnn::LookupParameters *lp = lookup_params_list[param_idx];
+        const ModelFileParam &block = tmp_mapped->lookup_param(param_idx);
+        unsigned cols = lp->values.empty() ? 0U : lp->values[0].d.size();
+        if (block.rows != lp->values.size() || block.cols != cols) throw std::runtime_error("binary model parameter of another shape");
+        const float *values = tmp_mapped->values(block);
+        for (unsigned r = 0; r < block.rows; ++r) std::copy(values + r * cols, values + (r + 1U) * cols, lp->values[r].v);
+    }
+    mapped_model = tmp_mapped;
+    BOOST_LOG_TRIVIAL(info) << "loaded ." ;
+}
+
+template <typename RNNType>
+void PoemGeneratorHandler<RNNType>::read_binary_model_header(const MappedModelFile &mapped)
+{
+    const ModelFileHeader &header = mapped.header();
+    if (header.rnn_type != static_cast<std::uint32_t>(ModelFileRNNTypeOf<RNNType>::value))
+    {
+        throw std::runtime_error("binary model was trained with another RNN type");
+    }
+    pg.word_embedding_dim = header.word_embedding_dim;
+    pg.word_dict_size = header.word_dict_size;
+    pg.enc_h_dim = header.enc_h_dim;
+    pg.enc_stacked_layer_num = header.enc_stacked_layer_num;
+    pg.enc_hidden_layer_output_dim = header.enc_hidden_layer_output_dim;
+    pg.enc_output_layer_output_dim = header.enc_output_layer_output_dim;
+    pg.dec_h_dim = header.dec_h_dim;
+    pg.dec_stacked_layer_num = header.dec_stacked_layer_num;
+    // the words are in index order , the unknown word among them
+    std::vector<std::string> words;
+    mapped.words(words);
+    for (const std::string &word : words) pg.word_dict.Convert(word);
+    pg.word_dict.Freeze();
+    pg.word_dict.SetUnk(pg.UNK_STR);
+    assert(pg.word_dict.size() == pg.word_dict_size);
+}
+
+template <typename RNNType>
+void PoemGeneratorHandler<RNNType>::load_inference_model(const std::string &model_path)
+{
+    if (!is_binary_model_file(model_path))
+    {
+        BOOST_LOG_TRIVIAL(warning) << "`" << model_path << "` is a text model , loading it with a full cnn model . "
+            "`poem_generate convert` writes a binary model that loads without one";
+        load_model(model_path);
+        return;
+    }
+    BOOST_LOG_TRIVIAL(info) << "mapping binary model for inference only ..." ;
+    std::shared_ptr<MappedModelFile> tmp_mapped(new MappedModelFile());
+    tmp_mapped->open(model_path);
+    read_binary_model_header(*tmp_mapped);
+    pg.EOS_idx = pg.word_dict.Convert(pg.EOS_STR);
+    pg.print_model_info();
+    mapped_model = tmp_mapped;
+    inference_only = true;
+    BOOST_LOG_TRIVIAL(info) << "loaded ." ;
+}
+
+template <typename RNNType>
+void PoemGeneratorHandler<RNNType>::log_memory_usage()
+{
+    const std::size_t MB = 1 << 20;
+    if (pg.m)
+    {
+        std::size_t nr_values = 0U;
+        for (const cnn::Parameters *p : pg.m->parameters_list()) nr_values += p->dim.size();
+        for (const cnn::LookupParameters *lp : pg.m->lookup_parameters_list()) nr_values += lp->values.size() * lp->dim.size();
+        double values_mb = static_cast<double>(nr_values * sizeof(cnn::real)) / MB;
+        BOOST_LOG_TRIVIAL(info) << "cnn model : values " << values_mb << " MB , gradients " << values_mb << " MB";
+    }
+    if (!use_native_engine) return;
+    std::map<std::string, InferenceEngine::GroupBytes> groups;
+    engine.weight_bytes_by_group(groups);
+    for (const auto &group : groups)
+    {
+        BOOST_LOG_TRIVIAL(info) << "native engine " << group.first << " : " << static_cast<double>(group.second.owned) / MB
+            << " MB owned , " << static_cast<double>(group.second.mapped) / MB << " MB mapped";
+    }
+}
+
+template <typename RNNType>
+void PoemGeneratorHandler<RNNType>::load_model(const std::string &model_path)
+{
+    if (is_binary_model_file(model_path))
+    {
+        load_binary_model(model_path);
+        return;
+    }
+    std::ifstream is(model_path);
+    if (!is) throw std::runtime_error("failed to open model at `" + model_path + "`");
+    load_model(is);
+}
+
+template <typename RNNType>
+void PoemGeneratorHandler<RNNType>::enable_native_engine()
+{
+    BOOST_LOG_TRIVIAL(info) << "extracting weights for native inference engine ...";
+    if (inference_only) engine.load_from(mapped_model);
+    else engine.load_from(pg, mapped_model);
+    engine.set_poem_sent_num(poem_sent_num);
+    use_native_engine = true;
+}
+
+template <typename RNNType>
+void PoemGeneratorHandler<RNNType>::set_poem_sent_num(std::size_t sent_num)
+{
+    poem_sent_num = sent_num;
+    if (use_native_engine) engine.set_poem_sent_num(sent_num);
+}
+
+template <typename RNNType>
+void PoemGeneratorHandler<RNNType>::enable_graph_replay()
+{
+    use_graph_replay = true;
+}
+
+template <typename RNNType>
+void PoemGeneratorHandler<RNNType>::load_shortlist(std::ifstream &is)
+{
+    assert(use_native_engine);
+    BOOST_LOG_TRIVIAL(info) << "loading vocabulary shortlist ...";
+    std::shared_ptr<VocabShortlist> shortlist = std::make_shared<VocabShortlist>();
+    shortlist->load(is);
+    engine.set_vocab_shortlist(shortlist);
+}
+
 template <typename RNNType>
 void PoemGeneratorHandler<RNNType>::slice_utf8_sents2single_words(const std::string &usent, 
         std::vector<std::string> &words_cont)
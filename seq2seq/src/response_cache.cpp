@@ -0,0 +1,103 @@
+#include "response_cache.h"
+
+#include <boost/archive/text_iarchive.hpp>
+#include <boost/archive/text_oarchive.hpp>
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/vector.hpp>
+#include <boost/log/trivial.hpp>
+
+using namespace std;
+
+ResponseCache::ResponseCache(size_t max_bytes, unsigned ttl_seconds)
+    :max_bytes(max_bytes), ttl(ttl_seconds), used_bytes(0),
+    hit_cnt(0), miss_cnt(0)
+{}
+
+size_t ResponseCache::entry_bytes(const string &key, const vector<string> &poem)
+{
+    // rough bookkeeping overhead of list node , hash node and strings
+    size_t nr_bytes = 128U + key.size() * 2U;
+    for (const string &sent : poem) nr_bytes += sizeof(string) + sent.size();
+    return nr_bytes;
+}
+
+bool ResponseCache::get(const string &key, vector<string> &poem)
+{
+    if (!is_enabled()) return false;
+    auto ite = entries.find(key);
+    if (ite == entries.end())
+    {
+        ++miss_cnt;
+        return false;
+    }
+    if (ttl.count() > 0 && ite->second->expire_time <= Clock::now())
+    {
+        erase(ite->second);
+        ++miss_cnt;
+        return false;
+    }
+    ++hit_cnt;
+    lru_list.splice(lru_list.begin(), lru_list, ite->second);
+    poem = ite->second->poem;
+    return true;
+}
+
+void ResponseCache::put(const string &key, const vector<string> &poem)
+{
+    if (!is_enabled()) return;
+    Entry entry = { key, poem, Clock::now() + ttl, entry_bytes(key, poem) };
+    insert(std::move(entry));
+}
+
+void ResponseCache::insert(Entry &&entry)
+{
+    if (entry.bytes > max_bytes) return;
+    auto ite = entries.find(entry.key);
+    if (ite != entries.end()) erase(ite->second);
+    used_bytes += entry.bytes;
+    lru_list.push_front(std::move(entry));
+    entries[lru_list.front().key] = lru_list.begin();
+    while (used_bytes > max_bytes) erase(std::prev(lru_list.end()));
+}
+
+void ResponseCache::erase(list<Entry>::iterator ite)
+{
+    used_bytes -= ite->bytes;
+    entries.erase(ite->key);
+    lru_list.erase(ite);
+}
+
+void ResponseCache::save(ostream &os) const
+{
+    boost::archive::text_oarchive to(os);
+    size_t nr_entries = lru_list.size();
+    to << nr_entries;
+    // least recently used first , so that loading in order restores the recency
+    for (auto ite = lru_list.crbegin(); ite != lru_list.crend(); ++ite)
+    {
+        long long expire_seconds = chrono::duration_cast<chrono::seconds>(ite->expire_time.time_since_epoch()).count();
+        to << ite->key << ite->poem << expire_seconds;
+    }
+    BOOST_LOG_TRIVIAL(info) << "response cache saved , " << nr_entries << " entries";
+}
+
+void ResponseCache::load(istream &is)
+{
+    boost::archive::text_iarchive ti(is);
+    size_t nr_entries = 0U,
+        nr_loaded = 0U;
+    ti >> nr_entries;
+    Clock::time_point now = Clock::now();
+    for (size_t idx = 0; idx < nr_entries; ++idx)
+    {
+        Entry entry;
+        long long expire_seconds = 0;
+        ti >> entry.key >> entry.poem >> expire_seconds;
+        entry.expire_time = Clock::time_point(chrono::seconds(expire_seconds));
+        if (ttl.count() > 0 && entry.expire_time <= now) continue;
+        entry.bytes = entry_bytes(entry.key, entry.poem);
+        insert(std::move(entry));
+        ++nr_loaded;
+    }
+    BOOST_LOG_TRIVIAL(info) << "response cache loaded , " << nr_loaded << " of " << nr_entries << " entries";
+}
@@ -0,0 +1,56 @@
+#ifndef RESPONSE_CACHE_H_INCLUDED
+#define RESPONSE_CACHE_H_INCLUDED
+#include <list>
+#include <unordered_map>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <iostream>
+
+/*
+ * Whole-response cache for the REST server .
+ * key is the normalized first line plus decoding parameters , value is the generated poem .
+ * entries are evicted in LRU order when the memory cap is exceeded , and expire after TTL .
+ * the cache can be saved to / loaded from a boost text archive to survive restarts .
+ */
+class ResponseCache
+{
+public:
+    // max_bytes = 0 disables the cache , ttl_seconds = 0 means never expire
+    ResponseCache(std::size_t max_bytes, unsigned ttl_seconds);
+
+    bool get(const std::string &key, std::vector<std::string> &poem);
+    void put(const std::string &key, const std::vector<std::string> &poem);
+
+    void save(std::ostream &os) const;
+    void load(std::istream &is);
+
+    bool is_enabled() const { return max_bytes > 0U; }
+    std::size_t size() const { return lru_list.size(); }
+    std::size_t bytes() const { return used_bytes; }
+    unsigned long long hits() const { return hit_cnt; }
+    unsigned long long misses() const { return miss_cnt; }
+
+private:
+    using Clock = std::chrono::system_clock;
+    struct Entry
+    {
+        std::string key;
+        std::vector<std::string> poem;
+        Clock::time_point expire_time;
+        std::size_t bytes;
+    };
+    std::size_t max_bytes;
+    std::chrono::seconds ttl;
+    std::size_t used_bytes;
+    std::list<Entry> lru_list; // most recently used at front
+    std::unordered_map<std::string, std::list<Entry>::iterator> entries;
+    unsigned long long hit_cnt;
+    unsigned long long miss_cnt;
+
+    void insert(Entry &&entry);
+    void erase(std::list<Entry>::iterator ite);
+    static std::size_t entry_bytes(const std::string &key, const std::vector<std::string> &poem);
+};
+
+#endif
@@ -0,0 +1,183 @@
+#include "scheduler_thread.h"
+
+#include <algorithm>
+
+using namespace std;
+
+SchedulerThread::SchedulerThread(const InferenceEngine &engine, size_t max_batch_size, size_t max_bulk_batch_size,
+    chrono::milliseconds max_queue_time, FinishedCallback on_finished, ShedCallback on_shed)
+    :scheduler(engine, max_batch_size), max_batch_size(max_batch_size), max_bulk_batch_size(max_bulk_batch_size),
+    max_queue_time(max_queue_time), active_bulk(0U), on_finished(on_finished), on_shed(on_shed), stopping(false),
+    nr_active(0U), nr_queued(0U), nr_active_bulk(0U), nr_queued_bulk(0U)
+{
+    worker = thread(&SchedulerThread::run, this);
+}
+
+SchedulerThread::~SchedulerThread()
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        stopping = true;
+    }
+    inbox_cv.notify_one();
+    worker.join();
+}
+
+void SchedulerThread::submit(Tag tag, const IndexSeq &first_seq, const DecodeOptions &opts, RequestPriority priority)
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        submissions.push_back(Submission{ tag, first_seq, opts, priority, Clock::now() });
+    }
+    inbox_cv.notify_one();
+}
+
+void SchedulerThread::cancel(Tag tag)
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        cancellations.push_back(tag);
+    }
+    inbox_cv.notify_one();
+}
+
+void SchedulerThread::apply_cancellations(const vector<Tag> &cancelled_tags)
+{
+    auto is_cancelled = [&cancelled_tags](Tag tag)
+    {
+        return find(cancelled_tags.begin(), cancelled_tags.end(), tag) != cancelled_tags.end();
+    };
+    for (deque<Submission> *queue : { &waiting, &waiting_bulk })
+    {
+        queue->erase(remove_if(queue->begin(), queue->end(),
+            [&is_cancelled](const Submission &submission){ return is_cancelled(submission.tag); }), queue->end());
+    }
+    for (auto ite = active.begin(); ite != active.end(); )
+    {
+        if (!is_cancelled(ite->second.tag)) ++ite;
+        else
+        {
+            scheduler.cancel(ite->first);
+            if (RequestPriority::Bulk == ite->second.priority) --active_bulk;
+            ite = active.erase(ite);
+        }
+    }
+}
+
+void SchedulerThread::shed_waiting(deque<Submission> &queue, Clock::time_point shed_before, vector<Tag> &shed)
+{
+    // oldest first
+    while (!queue.empty() && queue.front().submit_time < shed_before)
+    {
+        shed.push_back(queue.front().tag);
+        queue.pop_front();
+    }
+}
+
+void SchedulerThread::shed_expired(Clock::time_point now, vector<Tag> &shed)
+{
+    for (deque<Submission> *queue : { &waiting, &waiting_bulk })
+    {
+        for (auto ite = queue->begin(); ite != queue->end(); )
+        {
+            if (ite->opts.deadline >= now) ++ite;
+            else
+            {
+                shed.push_back(ite->tag);
+                ite = queue->erase(ite);
+            }
+        }
+    }
+    for (auto ite = active.begin(); ite != active.end(); )
+    {
+        if (ite->second.deadline >= now) ++ite;
+        else
+        {
+            shed.push_back(ite->second.tag);
+            scheduler.cancel(ite->first);
+            if (RequestPriority::Bulk == ite->second.priority) --active_bulk;
+            ite = active.erase(ite);
+        }
+    }
+}
+
+void SchedulerThread::start(deque<Submission> &queue)
+{
+    Submission &submission = queue.front();
+    active[scheduler.submit(submission.first_seq, submission.opts)]
+        = ActiveRequest{ submission.tag, submission.priority, submission.opts.deadline };
+    if (RequestPriority::Bulk == submission.priority) ++active_bulk;
+    queue.pop_front();
+}
+
+void SchedulerThread::admit(vector<Tag> &shed)
+{
+    Clock::time_point now = Clock::now();
+    shed_expired(now, shed);
+    if (max_queue_time.count() > 0)
+    {
+        Clock::time_point shed_before = now - max_queue_time;
+        shed_waiting(waiting, shed_before, shed);
+        shed_waiting(waiting_bulk, shed_before, shed);
+    }
+    while (!waiting.empty() && active.size() < max_batch_size) start(waiting);
+    while (!waiting_bulk.empty() && active.size() < max_batch_size && active_bulk < max_bulk_batch_size) start(waiting_bulk);
+}
+
+void SchedulerThread::run()
+{
+    vector<Submission> new_submissions;
+    vector<Tag> new_cancellations,
+        shed;
+    vector<BatchScheduler::FinishedPoem> finished;
+    vector<pair<Tag, Poem>> finished_tags;
+    unique_lock<mutex> lock(mtx);
+    while (true)
+    {
+        // the last step may have freed slots for the waiting requests
+        inbox_cv.wait(lock, [this]
+        {
+            return stopping || !submissions.empty() || !cancellations.empty() || !scheduler.idle()
+                || !waiting.empty() || !waiting_bulk.empty();
+        });
+        if (stopping) return;
+        swap(new_submissions, submissions);
+        swap(new_cancellations, cancellations);
+        lock.unlock();
+        // a request cancelled right after its submission is submitted first
+        for (Submission &submission : new_submissions)
+        {
+            (RequestPriority::Bulk == submission.priority ? waiting_bulk : waiting).push_back(std::move(submission));
+        }
+        new_submissions.clear();
+        if (!new_cancellations.empty())
+        {
+            apply_cancellations(new_cancellations);
+            new_cancellations.clear();
+        }
+        admit(shed);
+        nr_queued = waiting.size() + waiting_bulk.size();
+        nr_queued_bulk = waiting_bulk.size();
+        if (!shed.empty())
+        {
+            on_shed(shed);
+            shed.clear();
+        }
+        if (!scheduler.idle()) scheduler.step(finished);
+        for (BatchScheduler::FinishedPoem &result : finished)
+        {
+            auto ite = active.find(result.first);
+            if (ite == active.end()) continue;
+            finished_tags.push_back(make_pair(ite->second.tag, Poem()));
+            swap(finished_tags.back().second, result.second);
+            if (RequestPriority::Bulk == ite->second.priority) --active_bulk;
+            active.erase(ite);
+        }
+        nr_active = active.size();
+        nr_active_bulk = active_bulk;
+        finished.clear();
+        if (!finished_tags.empty()) on_finished(finished_tags);
+        finished_tags.clear();
+        lock.lock();
+    }
+}
@@ -0,0 +1,102 @@
+#ifndef SCHEDULER_THREAD_H_INCLUDED
+#define SCHEDULER_THREAD_H_INCLUDED
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+
+#include "batch_scheduler.h"
+#include "typedec.h"
+
+/*
+ * A BatchScheduler stepped on its own thread , so the loop taking requests never waits for a decoding step .
+ * requests are identified by the caller's tags ; submissions and cancellations are queued and applied between steps .
+ * a submitted request waits in a queue until the batch has a free slot ; one that waited longer than `max_queue_time`
+ * is shed without decoding , as the client is better told to come back than kept waiting for a late answer .
+ * a request past its deadline (see `DecodeOptions::deadline`) is shed as well , waiting or decoding , as nobody waits for it .
+ * free slots go to the waiting interactive requests first ; bulk requests take what is left , up to
+ * `max_bulk_batch_size` slots , so a batch full of bulk work never holds interactive requests back for long .
+ * results are handed to the callbacks on the scheduler thread , which pass them back to the caller's loop
+ * (e.g. by `mg_broadcast`) .
+ */
+class SchedulerThread
+{
+public:
+    using Tag = unsigned long long;
+    using Clock = std::chrono::steady_clock;
+    using FinishedCallback = std::function<void(std::vector<std::pair<Tag, Poem>> &finished)>;
+    using ShedCallback = std::function<void(std::vector<Tag> &shed)>;
+
+    // `max_queue_time` zero to never shed
+    SchedulerThread(const InferenceEngine &engine, std::size_t max_batch_size, std::size_t max_bulk_batch_size,
+        std::chrono::milliseconds max_queue_time, FinishedCallback on_finished, ShedCallback on_shed);
+    // drops the unfinished requests , joins the thread : a callback running meanwhile must not wait on the caller
+    ~SchedulerThread();
+    SchedulerThread(const SchedulerThread&) = delete;
+    SchedulerThread &operator=(const SchedulerThread&) = delete;
+
+    // without a shortlist , see `BatchScheduler::submit`
+    void submit(Tag tag, const IndexSeq &first_seq, const DecodeOptions &opts = DecodeOptions(),
+        RequestPriority priority = RequestPriority::Interactive);
+    // a finished or unknown tag is ignored
+    void cancel(Tag tag);
+
+    // as of the last step
+    std::size_t active_size() const { return nr_active; }
+    std::size_t queued_size() const { return nr_queued; }
+    std::size_t active_bulk_size() const { return nr_active_bulk; }
+    std::size_t queued_bulk_size() const { return nr_queued_bulk; }
+
+private:
+    struct Submission
+    {
+        Tag tag;
+        IndexSeq first_seq;
+        DecodeOptions opts;
+        RequestPriority priority;
+        Clock::time_point submit_time;
+    };
+    struct ActiveRequest
+    {
+        Tag tag;
+        RequestPriority priority;
+        Clock::time_point deadline;
+    };
+
+    BatchScheduler scheduler; // scheduler thread only
+    std::size_t max_batch_size;
+    std::size_t max_bulk_batch_size;
+    std::chrono::milliseconds max_queue_time;
+    // scheduler thread only
+    std::deque<Submission> waiting;
+    std::deque<Submission> waiting_bulk;
+    std::unordered_map<BatchScheduler::RequestId, ActiveRequest> active;
+    std::size_t active_bulk;
+    FinishedCallback on_finished;
+    ShedCallback on_shed;
+    std::mutex mtx;
+    std::condition_variable inbox_cv;
+    std::vector<Submission> submissions;
+    std::vector<Tag> cancellations;
+    bool stopping;
+    std::atomic<std::size_t> nr_active;
+    std::atomic<std::size_t> nr_queued;
+    std::atomic<std::size_t> nr_active_bulk;
+    std::atomic<std::size_t> nr_queued_bulk;
+    std::thread worker;
+
+    void run();
+    void apply_cancellations(const std::vector<Tag> &cancelled_tags);
+    // sheds the requests past their deadline or waiting too long , then fills the free slots of the batch
+    void admit(std::vector<Tag> &shed);
+    void shed_waiting(std::deque<Submission> &queue, Clock::time_point shed_before, std::vector<Tag> &shed);
+    void shed_expired(Clock::time_point now, std::vector<Tag> &shed);
+    void start(std::deque<Submission> &queue);
+};
+
+#endif
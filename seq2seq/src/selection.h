@@ -0,0 +1,317 @@
+#ifndef SELECTION_H_INCLUDED
+#define SELECTION_H_INCLUDED
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <algorithm>
+#include <functional>
+#include <Eigen/Dense>
+
+#include "typedec.h"
+
+/*
+ * Selection kernels working in place on the output score buffer .
+ * excluded words (the no-repeat rule) are kept in a dense bitmap ;
+ * scores are scanned in blocks of 64 , one bitmap word per block , and the block max is a vectorized reduction .
+ * no heap allocation happens inside the kernels .
+ * the kernels may also give the log normalizer of the scores , log(sum(exp(scores))) , from the same pass .
+ */
+
+class ExclusionBitmap
+{
+public:
+    static const std::size_t BlockSize = 64U;
+
+    ExclusionBitmap() {}
+    explicit ExclusionBitmap(std::size_t nr_words) :bits((nr_words + BlockSize - 1U) / BlockSize, 0U) {}
+    void reset(std::size_t nr_words) { bits.assign((nr_words + BlockSize - 1U) / BlockSize, 0U); }
+    void set(Index idx) { bits[idx / BlockSize] |= std::uint64_t(1U) << (idx % BlockSize); }
+    bool test(Index idx) const { return (bits[idx / BlockSize] >> (idx % BlockSize)) & 1U; }
+    std::uint64_t block(std::size_t block_idx) const { return bits[block_idx]; }
+
+private:
+    std::vector<std::uint64_t> bits;
+};
+
+struct ScoredIndex
+{
+    float score;
+    Index idx;
+    bool operator>(const ScoredIndex &other) const { return score > other.score; }
+};
+
+namespace selection_detail
+{
+// returns the scores of the block , with excluded entries masked to -inf in `buf` when needed
+inline const float *masked_block(const float *block, std::size_t block_len, std::uint64_t mask, float *buf)
+{
+    if (0U == mask) return block;
+    for (std::size_t i = 0; i < block_len; ++i)
+    {
+        buf[i] = ((mask >> i) & 1U) ? -std::numeric_limits<float>::infinity() : block[i];
+    }
+    return buf;
+}
+
+// log(sum(exp(x))) over blocks added one by one : a running max , and the sum of exp(x - max) rescaled when it grows
+class LogSumExp
+{
+public:
+    LogSumExp() :max_score(-std::numeric_limits<float>::infinity()), sum_exp(0.f) {}
+    void add(const float *block, std::size_t block_len, float block_max)
+    {
+        if (block_max == -std::numeric_limits<float>::infinity()) return;
+        if (block_max > max_score)
+        {
+            sum_exp *= std::exp(max_score - block_max);
+            max_score = block_max;
+        }
+        sum_exp += (Eigen::Map<const Eigen::ArrayXf>(block, block_len) - max_score).exp().sum();
+    }
+    void add(const float *block, std::size_t block_len)
+    {
+        add(block, block_len, Eigen::Map<const Eigen::ArrayXf>(block, block_len).maxCoeff());
+    }
+    float value() const { return max_score + std::log(sum_exp); }
+
+private:
+    float max_score;
+    float sum_exp; // of exp(x - max_score)
+};
+
+// keeps the `k` best candidates in the min-heap out[0 , nr_out)
+inline void push_top_k(ScoredIndex *out, std::size_t &nr_out, std::size_t k, const ScoredIndex &cand)
+{
+    if (nr_out < k)
+    {
+        out[nr_out++] = cand;
+        std::push_heap(out, out + nr_out, std::greater<ScoredIndex>());
+    }
+    else if (cand > out[0])
+    {
+        std::pop_heap(out, out + nr_out, std::greater<ScoredIndex>());
+        out[nr_out - 1] = cand;
+        std::push_heap(out, out + nr_out, std::greater<ScoredIndex>());
+    }
+}
+}
+
+// index of the highest score not excluded , the first one on ties . -1 if every word is excluded .
+// `log_z` , if given , gets the log normalizer of all the scores , the excluded ones too
+inline Index masked_argmax(const float *scores, std::size_t nr_scores, const ExclusionBitmap &excluded,
+    float *log_z = nullptr)
+{
+    Index best_idx = -1;
+    float best_score = -std::numeric_limits<float>::infinity();
+    float buf[ExclusionBitmap::BlockSize];
+    selection_detail::LogSumExp lse;
+    for (std::size_t block_begin = 0; block_begin < nr_scores; block_begin += ExclusionBitmap::BlockSize)
+    {
+        std::size_t block_len = std::min(ExclusionBitmap::BlockSize, nr_scores - block_begin);
+        std::uint64_t mask = excluded.block(block_begin / ExclusionBitmap::BlockSize);
+        const float *block = selection_detail::masked_block(scores + block_begin, block_len, mask, buf);
+        float block_max = Eigen::Map<const Eigen::VectorXf>(block, block_len).maxCoeff();
+        if (log_z && 0U == mask) lse.add(block, block_len, block_max);
+        else if (log_z) lse.add(scores + block_begin, block_len);
+        if (block_max > best_score)
+        {
+            std::size_t pos = 0;
+            while (block[pos] != block_max) ++pos;
+            best_score = block_max;
+            best_idx = static_cast<Index>(block_begin + pos);
+        }
+    }
+    if (log_z) *log_z = lse.value();
+    return best_idx;
+}
+
+// the `k` highest scores not excluded , written to `out` in descending order . returns the number written .
+// `log_z` , if given , gets the log normalizer of all the scores , the excluded ones too
+inline std::size_t masked_top_k(const float *scores, std::size_t nr_scores, const ExclusionBitmap &excluded,
+    std::size_t k, ScoredIndex *out, float *log_z = nullptr)
+{
+    if (0U == k && !log_z) return 0U;
+    std::size_t nr_out = 0U;
+    float buf[ExclusionBitmap::BlockSize];
+    selection_detail::LogSumExp lse;
+    for (std::size_t block_begin = 0; block_begin < nr_scores; block_begin += ExclusionBitmap::BlockSize)
+    {
+        std::size_t block_len = std::min(ExclusionBitmap::BlockSize, nr_scores - block_begin);
+        std::uint64_t mask = excluded.block(block_begin / ExclusionBitmap::BlockSize);
+        const float *block = selection_detail::masked_block(scores + block_begin, block_len, mask, buf);
+        float block_max = Eigen::Map<const Eigen::VectorXf>(block, block_len).maxCoeff();
+        if (log_z && 0U == mask) lse.add(block, block_len, block_max);
+        else if (log_z) lse.add(scores + block_begin, block_len);
+        // out[0 , nr_out) is a min-heap once full ; skip blocks that can not enter it
+        if (0U == k || (nr_out == k && block_max <= out[0].score)) continue;
+        for (std::size_t pos = 0; pos < block_len; ++pos)
+        {
+            if (block[pos] == -std::numeric_limits<float>::infinity()) continue;
+            ScoredIndex cand = { block[pos], static_cast<Index>(block_begin + pos) };
+            selection_detail::push_top_k(out, nr_out, k, cand);
+        }
+    }
+    std::sort_heap(out, out + nr_out, std::greater<ScoredIndex>());
+    if (log_z) *log_z = lse.value();
+    return nr_out;
+}
+
+struct SamplingParams
+{
+    float temperature; // <= 0 takes the best word
+    std::size_t top_k; // 0 for no limit
+    float top_p; // nucleus probability mass , 1 for no limit
+    SamplingParams() :temperature(0.f), top_k(0U), top_p(1.f) {}
+};
+
+// candidates kept for top-k / nucleus sampling , `buf` of `masked_sample` holds this many ; the largest `top_k` allowed
+const std::size_t MaxSampleCandidates = 256U;
+
+namespace selection_detail
+{
+/*
+ * nucleus sampling when the candidates hold less than `top_p` , the distribution is too flat for them .
+ * a second pass buckets the probability mass by log probability , `NucleusBucketWidth` steps below the best word ,
+ * and whole buckets are kept from the best one until `top_p` is reached ; a third pass samples among the words kept .
+ * `max_score` and `sum_exp` are the normalizer of scores / temperature over the words not excluded
+ */
+const std::size_t NrNucleusBuckets = 256U;
+const float NucleusBucketWidth = 0.125f; // in log probability , the last bucket takes everything below
+
+template <typename RNG>
+Index sample_wide_nucleus(const float *scores, std::size_t nr_scores, const ExclusionBitmap &excluded,
+    float inv_temperature, float max_score, float sum_exp, float top_p, RNG &rng)
+{
+    float bucket_mass[NrNucleusBuckets] = { 0.f };
+    auto bucket_of = [&](float score)
+    {
+        return std::min(static_cast<std::size_t>((max_score - score * inv_temperature) / NucleusBucketWidth),
+            NrNucleusBuckets - 1U);
+    };
+    for (std::size_t idx = 0; idx < nr_scores; ++idx)
+    {
+        if (excluded.test(static_cast<Index>(idx))) continue;
+        bucket_mass[bucket_of(scores[idx])] += std::exp(scores[idx] * inv_temperature - max_score) / sum_exp;
+    }
+    float kept_mass = 0.f;
+    std::size_t last_bucket = 0U;
+    for (; last_bucket < NrNucleusBuckets; ++last_bucket)
+    {
+        kept_mass += bucket_mass[last_bucket];
+        if (kept_mass >= top_p) break;
+    }
+    last_bucket = std::min(last_bucket, NrNucleusBuckets - 1U);
+    float target = std::uniform_real_distribution<float>(0.f, kept_mass)(rng);
+    Index last_kept = -1;
+    for (std::size_t idx = 0; idx < nr_scores; ++idx)
+    {
+        if (excluded.test(static_cast<Index>(idx)) || bucket_of(scores[idx]) > last_bucket) continue;
+        last_kept = static_cast<Index>(idx);
+        target -= std::exp(scores[idx] * inv_temperature - max_score) / sum_exp;
+        if (target < 0.f) return last_kept;
+    }
+    return last_kept;
+}
+}
+
+/*
+ * sample a word not excluded from softmax(scores / temperature) , in one pass over the scores .
+ * without top-k and nucleus limits it is the Gumbel-max trick : argmax(scores / temperature + gumbel noise) .
+ * otherwise the pass keeps the log normalizer (online log-sum-exp) and a heap of the best candidates together ,
+ * and only the candidates are sorted . `top_k` is at most `MaxSampleCandidates` (larger ones are cut to it) ;
+ * a nucleus wider than the candidates takes two more passes , see `sample_wide_nucleus` .
+ * `log_z` , if given , gets the log normalizer of all the scores , untempered and the excluded ones too , from the first pass .
+ * returns -1 if every word is excluded
+ */
+template <typename RNG>
+Index masked_sample(const float *scores, std::size_t nr_scores, const ExclusionBitmap &excluded,
+    const SamplingParams &params, RNG &rng, ScoredIndex *buf, float *log_z = nullptr)
+{
+    if (params.temperature <= 0.f) return masked_argmax(scores, nr_scores, excluded, log_z);
+    const float inf = std::numeric_limits<float>::infinity(),
+        inv_temperature = 1.f / params.temperature;
+    std::uniform_real_distribution<float> uniform(std::numeric_limits<float>::min(), 1.f);
+    float block_buf[ExclusionBitmap::BlockSize];
+    selection_detail::LogSumExp lse;
+    if (0U == params.top_k && params.top_p >= 1.f)
+    {
+        Index best_idx = -1;
+        float best_score = -inf;
+        for (std::size_t block_begin = 0; block_begin < nr_scores; block_begin += ExclusionBitmap::BlockSize)
+        {
+            std::size_t block_len = std::min(ExclusionBitmap::BlockSize, nr_scores - block_begin);
+            const float *block = selection_detail::masked_block(scores + block_begin, block_len,
+                excluded.block(block_begin / ExclusionBitmap::BlockSize), block_buf);
+            if (log_z) lse.add(scores + block_begin, block_len);
+            for (std::size_t pos = 0; pos < block_len; ++pos)
+            {
+                if (block[pos] == -inf) continue;
+                float perturbed = block[pos] * inv_temperature - std::log(-std::log(uniform(rng)));
+                if (perturbed > best_score)
+                {
+                    best_score = perturbed;
+                    best_idx = static_cast<Index>(block_begin + pos);
+                }
+            }
+        }
+        if (log_z) *log_z = lse.value();
+        return best_idx;
+    }
+    std::size_t k = 0U == params.top_k ? MaxSampleCandidates : std::min(params.top_k, MaxSampleCandidates),
+        nr_cand = 0U;
+    float max_score = -inf, // of scores / temperature
+        sum_exp = 0.f; // of exp(scores / temperature - max_score)
+    for (std::size_t block_begin = 0; block_begin < nr_scores; block_begin += ExclusionBitmap::BlockSize)
+    {
+        std::size_t block_len = std::min(ExclusionBitmap::BlockSize, nr_scores - block_begin);
+        std::uint64_t mask = excluded.block(block_begin / ExclusionBitmap::BlockSize);
+        const float *block = selection_detail::masked_block(scores + block_begin, block_len, mask, block_buf);
+        Eigen::Map<const Eigen::ArrayXf> block_scores(block, block_len);
+        float raw_block_max = block_scores.maxCoeff(),
+            block_max = raw_block_max * inv_temperature;
+        if (log_z && 0U == mask) lse.add(block, block_len, raw_block_max);
+        else if (log_z) lse.add(scores + block_begin, block_len);
+        if (block_max == -inf) continue;
+        if (block_max > max_score)
+        {
+            sum_exp *= std::exp(max_score - block_max);
+            max_score = block_max;
+        }
+        sum_exp += (block_scores * inv_temperature - max_score).exp().sum();
+        if (nr_cand == k && block_max <= buf[0].score) continue;
+        for (std::size_t pos = 0; pos < block_len; ++pos)
+        {
+            if (block[pos] == -inf) continue;
+            ScoredIndex cand = { block[pos] * inv_temperature, static_cast<Index>(block_begin + pos) };
+            selection_detail::push_top_k(buf, nr_cand, k, cand);
+        }
+    }
+    if (log_z) *log_z = lse.value();
+    if (0U == nr_cand) return -1;
+    std::sort_heap(buf, buf + nr_cand, std::greater<ScoredIndex>());
+    // probabilities of the sorted candidates , cut at the nucleus mass
+    float kept_mass = 0.f;
+    std::size_t nr_kept = 0U;
+    while (nr_kept < nr_cand && (0U == nr_kept || kept_mass < params.top_p))
+    {
+        buf[nr_kept].score = std::exp(buf[nr_kept].score - max_score) / sum_exp;
+        kept_mass += buf[nr_kept].score;
+        ++nr_kept;
+    }
+    if (kept_mass < params.top_p && 0U == params.top_k && nr_cand == MaxSampleCandidates)
+    {
+        return selection_detail::sample_wide_nucleus(scores, nr_scores, excluded, inv_temperature, max_score, sum_exp,
+            params.top_p, rng);
+    }
+    float target = std::uniform_real_distribution<float>(0.f, kept_mass)(rng);
+    for (std::size_t idx = 0; idx < nr_kept; ++idx)
+    {
+        target -= buf[idx].score;
+        if (target < 0.f) return buf[idx].idx;
+    }
+    return buf[nr_kept - 1U].idx;
+}
+
+#endif
@@ -3,21 +3,119 @@
 
 #include "poem_generate.h"
 #include "poem_generate_handler.h"
+#include "response_cache.h"
+#include "scheduler_thread.h"
+#include "worker_pool.h"
+
+#include <csignal>
+#include <chrono>
+#include <random>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 #include "thirdparty/mongoose.h"
 
+// `server_aot` target : greedy decoding kernel specialized on the model , written by `poem_generate codegen`
+#ifdef AOT_MODEL_HEADER
+#include AOT_MODEL_HEADER
+#endif
+
 using namespace std ;
 namespace po = boost::program_options ;
 
 // Mongoose
 static char s_http_port[10] = "6669" ;
 static void send_error_result(struct mg_connection *nc, const char *msg) ;
+static void send_poem_result(struct mg_connection *nc , const vector<string> &poem) ;
+static void send_overloaded_result(struct mg_connection *nc) ;
+static void send_deadline_exceeded_result(struct mg_connection *nc) ;
+static void send_bad_request_result(struct mg_connection *nc , const char *msg) ;
 static void rest_api(struct mg_connection *nc , struct http_message *hm) ;
 static void ev_handler(struct mg_connection *nc , int ev , void *ev_data) ;
+static bool parse_decode_options(struct http_message *hm , DecodeOptions &opts , size_t &n) ;
+static RequestPriority parse_priority(struct http_message *hm) ;
+static bool is_batchable(const DecodeOptions &opts , size_t n , size_t sent_len) ;
+static bool parse_deadline(struct http_message *hm , DecodeOptions &opts) ;
+static void stats_api(struct mg_connection *nc) ;
+static void signal_handler(int sig_num) ;
+static string make_cache_key(const string &first_seq , const DecodeOptions &opts , size_t n) ;
+static bool generate_async(struct mg_connection *nc , const string &first_seq , const IndexSeq &first_index_seq ,
+        const DecodeOptions &opts , size_t n , RequestPriority priority , const string &cache_key) ;
+static bool generate_response(const string &first_seq , const DecodeOptions &opts , size_t n , vector<string> &poem) ;
+static void on_poems_decoded(vector<pair<SchedulerThread::Tag , Poem>> &finished) ;
+static void on_requests_shed(vector<SchedulerThread::Tag> &shed) ;
+static void post_finished_jobs(vector<struct FinishedJob> &finished) ;
+static void on_jobs_finished(struct mg_connection *nc , int ev , void *ev_data) ;
+
+// what every serving process starts for itself : threads don't survive a fork
+struct ServeOptions
+{
+    bool parallel_encoder ;
+    unsigned worker_threads ;
+    unsigned max_batch_size ; // 0 without the batching scheduler
+    unsigned max_bulk_batch_size ;
+    string response_cache_path ;
+} ;
+static int serve(unsigned worker_idx , bool reuse_port , const ServeOptions &serve_opts) ;
+#ifndef _WIN32
+static struct mg_connection *bind_reuse_port(struct mg_mgr *mgr , const char *address) ;
+static int prefork(unsigned nr_workers , const ServeOptions &serve_opts) ;
+#endif
 
 // Poem Generator
 using ModelHandler = PoemGeneratorHandler<cnn::SimpleRNNBuilder> ;
 static shared_ptr<ModelHandler> p_pgh ;
+static DecodeOptions s_default_decode_opts ;
+static shared_ptr<ResponseCache> p_response_cache ;
+static mt19937_64 s_seed_rng(random_device{}()) ; // seeds of sampling requests without one
+static volatile sig_atomic_t s_exit_flag = 0 ;
+static unsigned s_worker_idx = 0U ; // prefork worker serving in this process
+
+// generation off the event loop : greedy and sampling requests are batched by the scheduler thread , the others run
+// on worker threads ; the results are posted back to the event loop by `mg_broadcast`
+struct PendingRequest
+{
+    struct mg_connection *nc ;
+    string cache_key ;
+    bool in_scheduler ; // to be cancelled if the connection closes
+    RequestPriority priority ;
+    chrono::steady_clock::time_point deadline ; // a shed request past it is answered by 504
+} ;
+struct FinishedJob
+{
+    unsigned long long job_id ;
+    bool shed ; // waited too long in the queue or past its deadline , not generated
+    bool is_narrowed ; // beam narrowed for the deadline , not what the cache key stands for
+    vector<string> poem ;
+} ;
+static struct mg_mgr *s_mgr = NULL ;
+static shared_ptr<SchedulerThread> p_scheduler ;
+static shared_ptr<WorkerPool> p_worker_pool ;
+static unsigned long long s_next_job_id = 0ULL ;
+static unordered_map<unsigned long long , PendingRequest> s_pending_jobs ; // event loop only
+static size_t s_nr_bulk_jobs = 0U ; // bulk ones of `s_pending_jobs`
+// `mg_broadcast` waits for the event loop to take the results , so once it stops polling the threads must not call it :
+// past `s_stop_posting` they don't , and the loop keeps polling while `s_nr_posting` threads may still be in it
+static atomic<bool> s_stop_posting(false) ;
+static atomic<unsigned> s_nr_posting(0U) ;
+static mutex s_finished_jobs_mtx ;
+static vector<FinishedJob> s_finished_jobs ;
+
+// admission control : requests beyond `s_max_in_flight` , or queued longer than `s_max_queue_time` , are answered by 503
+static size_t s_max_in_flight = 0U ; // 0 for no limit
+static chrono::milliseconds s_max_queue_time(0) ; // 0 for no limit
+static size_t s_max_bulk_in_flight = 0U ;
+static unsigned s_retry_after = 1U ;
+static unsigned long long s_shed_in_flight = 0ULL ; // event loop only
+static unsigned long long s_shed_queue_time = 0ULL ; // event loop only
+static unsigned long long s_deadline_exceeded = 0ULL ; // event loop only
+static unsigned s_default_deadline_ms = 0U ; // 0 for none
+static const long MaxDeadlineMs = 3600L * 1000L ; // longer deadlines are cut to it
 
 static const string ProgramDescription = "Poem Generator Server ." ;
 
@@ -31,6 +129,40 @@ int main(int argc , char *argv[])
         ("port,p" , po::value<string>()->default_value("6669") , "specify port" )
         ("model,m" , po::value<string>(),"poem generator model path")
         ("cnn-mem" , po::value<unsigned>()->default_value(512U) , "specify cnn pre-allocator memory size")
+        ("engine" , po::value<string>()->default_value("native") , "inference engine : `native` (graph-free) or `graph` (CNN computation graph)")
+        ("graph-replay" , "build one computation graph per line length and replay it with new indices (graph engine only)")
+        ("poem-lines" , po::value<unsigned>()->default_value(4U) , "lines of a generated poem : 4 (jueju) or 8 (lushi)")
+        ("beam-width" , po::value<unsigned>()->default_value(1U) , "default beam width , 1 for greedy . requests may override it by `beam_width` field")
+        ("temperature" , po::value<float>()->default_value(0.f) , "default sampling temperature , 0 to decode without sampling . requests may override it by `temperature` field (native engine only)")
+        ("top-k" , po::value<unsigned>()->default_value(0U) , "default top k limit of sampling , 0 for no limit , at most 256 . requests may override it by `top_k` field")
+        ("top-p" , po::value<float>()->default_value(1.f) , "default nucleus mass of sampling , 1 for no limit . requests may override it by `top_p` field")
+        ("encoder-cache-size" , po::value<unsigned>()->default_value(4096U) , "max number of first lines whose encoder states are cached , 0 to disable (native engine only)")
+        ("response-cache-mem" , po::value<unsigned>()->default_value(64U) , "memory cap of the response cache in MB , 0 to disable")
+        ("response-cache-ttl" , po::value<unsigned>()->default_value(3600U) , "seconds a cached response stays valid , 0 for never expire")
+        ("response-cache-file" , po::value<string>() , "file to load the response cache from at startup and save it to at exit")
+        ("max-batch-size" , po::value<unsigned>()->default_value(32U) , "max number of greedy requests decoded together by the continuous batching scheduler , 0 to decode every request on its own (native engine only)")
+        ("weight-precision" , po::value<string>()->default_value("fp32") , "precision of the served weights : fp32 , int8 , fp16 or bf16 (native engine only)")
+        ("calibration" , po::value<string>() , "weight conversion calibrated by `poem_generate quantize` , `--weight-precision` other than fp32 overrides its precision (native engine only)")
+        ("shortlist" , po::value<string>() , "vocabulary shortlist built by `poem_generate shortlist` , requests may turn it off by `shortlist=0` field (native engine only) . "
+            "greedy and sampling requests of one poem don't use it unless they ask by `shortlist=1` , with or without "
+            "the batching scheduler ; a shortlisted request decodes on its own")
+        ("projection-tables" , "precompute the first layer input of every RNN per character , a table row replaces a matrix product per step (native engine only)")
+        ("workers" , po::value<unsigned>()->default_value(1U) , "number of prefork worker processes listening on the port with SO_REUSEPORT , "
+            "sharing the weights loaded before the fork (mapped read-only for a binary model) . every worker has its own caches")
+        ("worker-threads" , po::value<unsigned>()->default_value(1U) , "number of threads generating the poems that don't go through the batching scheduler , "
+            "so the event loop keeps accepting and answering ; 0 to generate on the event loop . graph engine threads take turns")
+        ("max-in-flight" , po::value<unsigned>()->default_value(256U) , "max number of requests queued or generated off the event loop , "
+            "more are answered by 503 at once ; 0 for no limit")
+        ("max-queue-ms" , po::value<unsigned>()->default_value(3000U) , "milliseconds a request may wait for the scheduler or a worker thread , "
+            "then it is answered by 503 without being generated ; 0 for no limit")
+        ("bulk-share" , po::value<float>()->default_value(0.5f) , "share of the batch slots and of `--max-in-flight` that bulk requests "
+            "(`priority=bulk` field or `X-Priority: bulk` header) may take , interactive requests always go first")
+        ("default-deadline-ms" , po::value<unsigned>()->default_value(0U) , "milliseconds a request may take , requests may override it by "
+            "`deadline_ms` field or `X-Deadline-Ms` header . beam search narrows its beam as it gets close , "
+            "a request past it is dropped without (further) decoding and answered by 504 ; 0 for no deadline")
+        ("retry-after" , po::value<unsigned>()->default_value(1U) , "seconds of the `Retry-After` header of 503 responses")
+        ("parallel-encoder" , "run the two encoder directions on two threads , for lower latency at low load (native engine only)")
+        ("inference-only" , "serve a binary model from its mapping without building the cnn model , no gradients nor training memory pools (native engine only)")
         ("help,h" , "show help information") ;
     po::variables_map var_map ;
     po::store( po::command_line_parser(argc , argv).options(optparser).allow_unregistered().run() , var_map  ) ;
@@ -56,6 +188,31 @@ int main(int argc , char *argv[])
         return 1 ;
     }
     model_path = var_map["model"].as<string>() ;
+    string engine = var_map["engine"].as<string>() ;
+    if(engine != "native" && engine != "graph")
+    {
+        cerr << "unknown engine : `" << engine << "`" << endl ;
+        cerr << optparser << endl ;
+        return 1 ;
+    }
+    bool inference_only = 0 != var_map.count("inference-only") ;
+    if(inference_only && engine != "native")
+    {
+        cerr << "`--inference-only` needs the native engine" << endl ;
+        return 1 ;
+    }
+    unsigned poem_lines = var_map["poem-lines"].as<unsigned>() ;
+    if(poem_lines != 4U && poem_lines != 8U)
+    {
+        cerr << "poem lines should be 4 or 8 , got : " << poem_lines << endl ;
+        cerr << optparser << endl ;
+        return 1 ;
+    }
+    if(var_map["top-k"].as<unsigned>() > MaxSampleCandidates)
+    {
+        cerr << "top k should be at most " << MaxSampleCandidates << endl ;
+        return 1 ;
+    }
     
     // load model 
     ifstream model_is(model_path) ;
@@ -69,20 +226,131 @@ int main(int argc , char *argv[])
     char *cnn_arg0 = argv[0] ;
     char cnn_arg1[] = "--cnn-mem" ;
     char cnn_arg2[10] ;
-    strcpy(cnn_arg2 , to_string(var_map["cnn-mem"].as<unsigned>()).c_str()) ;
+    unsigned cnn_mem = var_map["cnn-mem"].as<unsigned>() ;
+    if(inference_only && var_map["cnn-mem"].defaulted()) cnn_mem = 3U ; // no graph is ever built , keep the pools minimal
+    strcpy(cnn_arg2 , to_string(cnn_mem).c_str()) ;
     char **cnn_argv = new char *[cnn_argc+1]{cnn_arg0 , cnn_arg1 , cnn_arg2 , NULL } ;
     cnn::Initialize( cnn_argc , cnn_argv , 1234);
     delete [] cnn_argv ;
     p_pgh.reset(new ModelHandler()) ;
-    p_pgh->load_model(model_is) ; model_is.close() ;
-    
+    model_is.close() ;
+    if(inference_only) p_pgh->load_inference_model(model_path) ;
+    else p_pgh->load_model(model_path) ;
+    p_pgh->set_poem_sent_num(poem_lines) ;
+    if(engine == "graph" && 0 != var_map.count("graph-replay")) p_pgh->enable_graph_replay() ;
+    if(engine == "native")
+    {
+        p_pgh->enable_native_engine() ;
+        WeightConversion conversion ;
+        if(0 != var_map.count("calibration"))
+        {
+            string calibration_path = var_map["calibration"].as<string>() ;
+            ifstream calibration_is(calibration_path) ;
+            if(!calibration_is)
+            {
+                cerr << "failed to open calibration at path : `" << calibration_path << "` \n" ;
+                return 1 ;
+            }
+            conversion.load(calibration_is) ;
+        }
+        WeightPrecision precision ;
+        if(!parse_weight_precision(var_map["weight-precision"].as<string>() , precision))
+        {
+            cerr << "unknown weight precision : `" << var_map["weight-precision"].as<string>() << "`" << endl ;
+            cerr << optparser << endl ;
+            return 1 ;
+        }
+        if(precision != WeightPrecision::FP32) conversion.precision = precision ;
+        p_pgh->engine.convert_weights(conversion) ;
+        if(0 != var_map.count("projection-tables")) p_pgh->engine.build_projection_tables() ;
+        p_pgh->engine.enable_encoder_cache(var_map["encoder-cache-size"].as<unsigned>()) ;
+        if(0 != var_map.count("shortlist"))
+        {
+            string shortlist_path = var_map["shortlist"].as<string>() ;
+            ifstream shortlist_is(shortlist_path) ;
+            if(!shortlist_is)
+            {
+                cerr << "failed to open shortlist at path : `" << shortlist_path << "` \n" ;
+                return 1 ;
+            }
+            p_pgh->load_shortlist(shortlist_is) ;
+        }
+#ifdef AOT_MODEL_HEADER
+        try
+        {
+            aot_model::set_kernels(p_pgh->engine) ;
+        }
+        catch(const runtime_error &e)
+        {
+            cerr << "can't serve the model by the compiled kernel : " << e.what() << endl ;
+            return 1 ;
+        }
+#endif
+    }
+    p_pgh->log_memory_usage() ;
+    s_default_decode_opts.beam_width = var_map["beam-width"].as<unsigned>() ;
+    s_default_decode_opts.sampling.temperature = var_map["temperature"].as<float>() ;
+    s_default_decode_opts.sampling.top_k = var_map["top-k"].as<unsigned>() ;
+    s_default_decode_opts.sampling.top_p = var_map["top-p"].as<float>() ;
+    // response cache
+    p_response_cache.reset(new ResponseCache(static_cast<size_t>(var_map["response-cache-mem"].as<unsigned>()) << 20 ,
+                var_map["response-cache-ttl"].as<unsigned>())) ;
+    string response_cache_path ;
+    if(0 != var_map.count("response-cache-file") && p_response_cache->is_enabled())
+    {
+        response_cache_path = var_map["response-cache-file"].as<string>() ;
+        ifstream cache_is(response_cache_path) ;
+        if(cache_is) p_response_cache->load(cache_is) ;
+    }
+
+    ServeOptions serve_opts ;
+    serve_opts.parallel_encoder = engine == "native" && 0 != var_map.count("parallel-encoder") ;
+    serve_opts.worker_threads = var_map["worker-threads"].as<unsigned>() ;
+    serve_opts.max_batch_size = engine == "native" ? var_map["max-batch-size"].as<unsigned>() : 0U ;
+    s_max_in_flight = var_map["max-in-flight"].as<unsigned>() ;
+    // bulk requests get at least one slot , or they would never run
+    float bulk_share = max(0.f , min(1.f , var_map["bulk-share"].as<float>())) ;
+    s_max_bulk_in_flight = max(static_cast<size_t>(1U) , static_cast<size_t>(s_max_in_flight * bulk_share)) ;
+    serve_opts.max_bulk_batch_size = max(1U , static_cast<unsigned>(serve_opts.max_batch_size * bulk_share)) ;
+    s_max_queue_time = chrono::milliseconds(var_map["max-queue-ms"].as<unsigned>()) ;
+    s_retry_after = var_map["retry-after"].as<unsigned>() ;
+    s_default_deadline_ms = var_map["default-deadline-ms"].as<unsigned>() ;
+    serve_opts.response_cache_path = response_cache_path ;
+    unsigned nr_workers = var_map["workers"].as<unsigned>() ;
+    if(nr_workers <= 1U) return serve(0U , false , serve_opts) ;
+#ifndef _WIN32
+    return prefork(nr_workers , serve_opts) ;
+#else
+    cerr << "`--workers` is not supported on Windows" << endl ;
+    return 1 ;
+#endif
+}
+
+static int serve(unsigned worker_idx , bool reuse_port , const ServeOptions &serve_opts)
+{
+    s_worker_idx = worker_idx ;
+    if(reuse_port) s_seed_rng.seed(random_device{}()) ; // workers forked from one process would draw the same seeds
+    // threads don't survive a fork , the helper thread is started by the serving process
+    if(serve_opts.parallel_encoder) p_pgh->engine.enable_parallel_encoder(true) ;
+
     // build Server using Mongoose
     struct mg_mgr mgr ;
     shared_ptr<struct mg_mgr> p_mgr(&mgr , mg_mgr_free) ; // using shared_ptr to avoid realse mgr handly at every exit point
     struct mg_connection *nc ;
 
     mg_mgr_init(&mgr , NULL) ;
+    s_mgr = &mgr ;
+    if(serve_opts.max_batch_size > 0U)
+    {
+        p_scheduler.reset(new SchedulerThread(p_pgh->engine , serve_opts.max_batch_size , serve_opts.max_bulk_batch_size , s_max_queue_time ,
+                    on_poems_decoded , on_requests_shed)) ;
+    }
+    if(serve_opts.worker_threads > 0U) p_worker_pool.reset(new WorkerPool(serve_opts.worker_threads)) ;
+#ifndef _WIN32
+    nc = reuse_port ? bind_reuse_port(&mgr , s_http_port) : mg_bind(&mgr , s_http_port , ev_handler) ;
+#else
     nc = mg_bind(&mgr , s_http_port , ev_handler) ;
+#endif
     if(nc == NULL)
     {
         cerr << "failed to listen at port "  << s_http_port <<  "\n"
@@ -90,40 +358,498 @@ int main(int argc , char *argv[])
         return 1 ;
     }
     mg_set_protocol_http_websocket(nc) ;
-    cerr << "starting RESTFful server on port " <<  s_http_port << endl  ;
-    for(;;)
+    cerr << "starting RESTFful server on port " <<  s_http_port ;
+    if(reuse_port) cerr << " , worker " << worker_idx ;
+    cerr << endl ;
+    signal(SIGINT , signal_handler) ;
+    signal(SIGTERM , signal_handler) ;
+    while(!s_exit_flag)
     {
         mg_mgr_poll(&mgr , 1000) ;
     }
+    // running steps and jobs may still post to `mgr` : the scheduler and worker threads are joined only once
+    // none of them can wait on the loop , their results are dropped
+    s_stop_posting = true ;
+    while(s_nr_posting > 0U) mg_mgr_poll(&mgr , 10) ;
+    p_scheduler.reset() ;
+    p_worker_pool.reset() ;
+    // one file for every worker , the first one saves its cache
+    if(!serve_opts.response_cache_path.empty() && 0U == worker_idx)
+    {
+        ofstream cache_os(serve_opts.response_cache_path) ;
+        if(cache_os) p_response_cache->save(cache_os) ;
+        else cerr << "failed to save response cache at path : `" << serve_opts.response_cache_path << "`\n" ;
+    }
     return 0 ;
 }
 
+#ifndef _WIN32
+static struct mg_connection *bind_reuse_port(struct mg_mgr *mgr , const char *address)
+{
+    // mongoose only sets SO_REUSEADDR , so the listener is opened here and handed over to it .
+    // `address` is `port` or `ip:port`
+    string host , port = address ;
+    size_t colon_pos = port.rfind(':') ;
+    if(colon_pos != string::npos)
+    {
+        host = port.substr(0 , colon_pos) ;
+        port = port.substr(colon_pos + 1) ;
+    }
+    struct sockaddr_in sa ;
+    memset(&sa , 0 , sizeof(sa)) ;
+    sa.sin_family = AF_INET ;
+    sa.sin_port = htons(static_cast<uint16_t>(strtoul(port.c_str() , NULL , 10))) ;
+    sa.sin_addr.s_addr = htonl(INADDR_ANY) ;
+    if(!host.empty() && inet_pton(AF_INET , host.c_str() , &sa.sin_addr) != 1) return NULL ;
+    int on = 1 ;
+    sock_t sock = socket(AF_INET , SOCK_STREAM , 0) ;
+    if(sock == INVALID_SOCKET) return NULL ;
+    if(setsockopt(sock , SOL_SOCKET , SO_REUSEADDR , &on , sizeof(on)) != 0
+        || setsockopt(sock , SOL_SOCKET , SO_REUSEPORT , &on , sizeof(on)) != 0
+        || bind(sock , reinterpret_cast<struct sockaddr*>(&sa) , sizeof(sa)) != 0
+        || listen(sock , SOMAXCONN) != 0)
+    {
+        closesocket(sock) ;
+        return NULL ;
+    }
+    struct mg_connection *nc = mg_add_sock(mgr , sock , ev_handler) ;
+    if(nc == NULL)
+    {
+        closesocket(sock) ;
+        return NULL ;
+    }
+    nc->flags |= MG_F_LISTENING ; // accept on it as on a `mg_bind` listener
+    return nc ;
+}
+
+static int prefork(unsigned nr_workers , const ServeOptions &serve_opts)
+{
+    // the model is loaded : its pages are shared copy-on-write , or mapped read-only for a binary model ,
+    // so a worker only adds its caches and decoding states . the kernel spreads connections over the listeners
+    vector<pid_t> workers(nr_workers , 0) ;
+    // a worker exiting soon after its start is restarted after a doubling delay ; after `MaxQuickFailures` in a row
+    // it likely never comes up (port taken , model unreadable , out of memory) and all the workers are stopped
+    const unsigned MaxQuickFailures = 5U ;
+    const chrono::seconds QuickFailureTime(10) ;
+    vector<chrono::steady_clock::time_point> started_at(nr_workers) ,
+        restart_at(nr_workers) ;
+    vector<unsigned> nr_quick_failures(nr_workers , 0U) ;
+    int exit_code = 0 ;
+    signal(SIGINT , signal_handler) ;
+    signal(SIGTERM , signal_handler) ;
+    cerr << "starting " << nr_workers << " workers" << endl ;
+    while(!s_exit_flag)
+    {
+        for(unsigned worker_idx = 0 ; worker_idx < nr_workers && !s_exit_flag ; ++worker_idx)
+        {
+            if(workers[worker_idx] > 0 || chrono::steady_clock::now() < restart_at[worker_idx]) continue ;
+            pid_t pid = fork() ;
+            if(pid == 0) _exit(serve(worker_idx , true , serve_opts)) ;
+            if(pid < 0)
+            {
+                cerr << "failed to fork worker " << worker_idx << endl ;
+                exit_code = 1 ;
+                s_exit_flag = SIGTERM ;
+                break ;
+            }
+            workers[worker_idx] = pid ;
+            started_at[worker_idx] = chrono::steady_clock::now() ;
+        }
+        // a signal cuts the sleep short , then the workers are stopped
+        int status ;
+        pid_t pid = waitpid(-1 , &status , WNOHANG) ;
+        if(pid <= 0)
+        {
+            sleep(1) ;
+            continue ;
+        }
+        auto ite = find(workers.begin() , workers.end() , pid) ;
+        if(ite == workers.end()) continue ;
+        *ite = 0 ;
+        if(s_exit_flag) continue ;
+        size_t worker_idx = ite - workers.begin() ;
+        chrono::steady_clock::time_point now = chrono::steady_clock::now() ;
+        if(now - started_at[worker_idx] < QuickFailureTime) ++nr_quick_failures[worker_idx] ;
+        else nr_quick_failures[worker_idx] = 0U ;
+        if(nr_quick_failures[worker_idx] >= MaxQuickFailures)
+        {
+            cerr << "worker " << worker_idx << " exited with status " << status << " , " << MaxQuickFailures
+                << " times in a row right after starting , stopping" << endl ;
+            exit_code = 1 ;
+            s_exit_flag = SIGTERM ;
+            continue ;
+        }
+        chrono::seconds delay(nr_quick_failures[worker_idx] > 0U ? 1 << (nr_quick_failures[worker_idx] - 1U) : 0) ;
+        restart_at[worker_idx] = now + delay ;
+        cerr << "worker " << worker_idx << " exited with status " << status << " , restarting in " << delay.count() << " s" << endl ;
+    }
+    for(pid_t pid : workers)
+    {
+        if(pid > 0) kill(pid , SIGTERM) ;
+    }
+    for(pid_t pid : workers)
+    {
+        if(pid > 0) waitpid(pid , NULL , 0) ;
+    }
+    return exit_code ;
+}
+#endif
+
+static void signal_handler(int sig_num)
+{
+    signal(sig_num , signal_handler) ;
+    s_exit_flag = sig_num ;
+}
+
 static void send_error_result(struct mg_connection *nc, const char *msg) 
 {
     mg_printf_http_chunk(nc, "Error: %s\n", msg);
     mg_send_http_chunk(nc, "", 0); /* Send empty chunk, the end of response */
 }
 
+static void send_overloaded_result(struct mg_connection *nc)
+{
+    mg_printf(nc , "HTTP/1.1 503 Service Unavailable\r\nRetry-After: %u\r\nTransfer-Encoding: chunked\r\n\r\n" , s_retry_after) ;
+    send_error_result(nc , "overloaded") ;
+}
+
+static void send_deadline_exceeded_result(struct mg_connection *nc)
+{
+    mg_printf(nc , "%s" , "HTTP/1.1 504 Gateway Timeout\r\nTransfer-Encoding: chunked\r\n\r\n") ;
+    send_error_result(nc , "deadline exceeded") ;
+}
+
+static void send_bad_request_result(struct mg_connection *nc , const char *msg)
+{
+    mg_printf(nc , "%s" , "HTTP/1.1 400 Bad Request\r\nTransfer-Encoding: chunked\r\n\r\n") ;
+    send_error_result(nc , msg) ;
+}
+
+static void send_poem_result(struct mg_connection *nc , const vector<string> &poem)
+{
+    mg_printf(nc, "%s", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+    for(const string &sent : poem)
+    {
+        mg_printf_http_chunk(nc , "%s\n" , sent.c_str()) ;
+    }
+    mg_send_http_chunk(nc , "" , 0) ; // end chunked
+}
+
+// returns at once , the request is answered by `on_jobs_finished` ;
+// false if there is no thread to generate it , it is up to the caller then
+static bool generate_async(struct mg_connection *nc , const string &first_seq , const IndexSeq &first_index_seq ,
+        const DecodeOptions &opts , size_t n , RequestPriority priority , const string &cache_key)
+{
+    // the scheduler shares one full vocabulary output layer over the batch , shortlisted requests decode on their own
+    bool use_scheduler = is_batchable(opts , n , first_index_seq.size()) && !opts.use_shortlist ;
+    if(!use_scheduler && !p_worker_pool) return false ;
+    bool is_bulk = RequestPriority::Bulk == priority ;
+    if(s_max_in_flight > 0U && (s_pending_jobs.size() >= s_max_in_flight || (is_bulk && s_nr_bulk_jobs >= s_max_bulk_in_flight)))
+    {
+        ++s_shed_in_flight ;
+        send_overloaded_result(nc) ;
+        return true ;
+    }
+    unsigned long long job_id = s_next_job_id++ ;
+    s_pending_jobs[job_id] = PendingRequest{ nc , cache_key , use_scheduler , priority , opts.deadline } ;
+    if(is_bulk) ++s_nr_bulk_jobs ;
+    if(use_scheduler)
+    {
+        p_scheduler->submit(job_id , first_index_seq , opts , priority) ;
+        return true ;
+    }
+    chrono::steady_clock::time_point submit_time = chrono::steady_clock::now() ;
+    p_worker_pool->submit([job_id , first_seq , opts , n , submit_time]()
+    {
+        vector<FinishedJob> finished(1) ;
+        finished[0].job_id = job_id ;
+        chrono::steady_clock::time_point now = chrono::steady_clock::now() ;
+        finished[0].shed = now > opts.deadline || (s_max_queue_time.count() > 0 && now - submit_time > s_max_queue_time) ;
+        finished[0].is_narrowed = !finished[0].shed && generate_response(first_seq , opts , n , finished[0].poem) ;
+        post_finished_jobs(finished) ;
+    } , priority) ;
+    return true ;
+}
+
+// returns true if the beam was narrowed for the deadline
+static bool generate_response(const string &first_seq , const DecodeOptions &opts , size_t n , vector<string> &poem)
+{
+    if(n <= 1U) return p_pgh->generate(first_seq , poem , opts) ;
+    // candidates are sent as blocks : a `log_prob` line , the poem lines , an empty line
+    vector<vector<string>> poems ;
+    vector<float> log_probs ;
+    bool is_narrowed = p_pgh->generate_n_best(first_seq , n , poems , log_probs , opts) ;
+    vector<string> tmp_poem ;
+    for(size_t poem_idx = 0 ; poem_idx < poems.size() ; ++poem_idx)
+    {
+        tmp_poem.push_back("log_prob\t" + to_string(log_probs[poem_idx])) ;
+        tmp_poem.insert(tmp_poem.end() , poems[poem_idx].begin() , poems[poem_idx].end()) ;
+        tmp_poem.push_back("") ;
+    }
+    swap(tmp_poem , poem) ;
+    return is_narrowed ;
+}
+
+// on the scheduler thread , once per decoding step that finished some poems
+static void on_poems_decoded(vector<pair<SchedulerThread::Tag , Poem>> &finished)
+{
+    vector<FinishedJob> jobs(finished.size()) ;
+    for(size_t job_idx = 0 ; job_idx < finished.size() ; ++job_idx)
+    {
+        jobs[job_idx].job_id = finished[job_idx].first ;
+        jobs[job_idx].shed = false ;
+        jobs[job_idx].is_narrowed = false ;
+        p_pgh->poem2sents(finished[job_idx].second , jobs[job_idx].poem) ;
+    }
+    post_finished_jobs(jobs) ;
+}
+
+// on the scheduler thread
+static void on_requests_shed(vector<SchedulerThread::Tag> &shed)
+{
+    vector<FinishedJob> jobs(shed.size()) ;
+    for(size_t job_idx = 0 ; job_idx < shed.size() ; ++job_idx)
+    {
+        jobs[job_idx].job_id = shed[job_idx] ;
+        jobs[job_idx].shed = true ;
+        jobs[job_idx].is_narrowed = false ;
+    }
+    post_finished_jobs(jobs) ;
+}
+
+// from any thread
+static void post_finished_jobs(vector<FinishedJob> &finished)
+{
+    {
+        lock_guard<mutex> lock(s_finished_jobs_mtx) ;
+        for(FinishedJob &job : finished) s_finished_jobs.push_back(std::move(job)) ;
+    }
+    char wakeup = 0 ;
+    ++s_nr_posting ;
+    if(!s_stop_posting) mg_broadcast(s_mgr , on_jobs_finished , &wakeup , sizeof(wakeup)) ;
+    --s_nr_posting ;
+}
+
+// called by `mg_broadcast` for every connection on the event loop , the first call answers all finished jobs
+static void on_jobs_finished(struct mg_connection *nc , int ev , void *ev_data)
+{
+    (void)nc ; (void)ev ; (void)ev_data ;
+    vector<FinishedJob> finished ;
+    {
+        lock_guard<mutex> lock(s_finished_jobs_mtx) ;
+        swap(finished , s_finished_jobs) ;
+    }
+    for(FinishedJob &job : finished)
+    {
+        auto ite = s_pending_jobs.find(job.job_id) ;
+        if(ite == s_pending_jobs.end()) continue ; // connection closed meanwhile
+        if(job.shed && chrono::steady_clock::now() > ite->second.deadline)
+        {
+            ++s_deadline_exceeded ;
+            send_deadline_exceeded_result(ite->second.nc) ;
+        }
+        else if(job.shed)
+        {
+            ++s_shed_queue_time ;
+            send_overloaded_result(ite->second.nc) ;
+        }
+        else
+        {
+            if(!ite->second.cache_key.empty() && !job.is_narrowed) p_response_cache->put(ite->second.cache_key , job.poem) ;
+            send_poem_result(ite->second.nc , job.poem) ;
+        }
+        if(RequestPriority::Bulk == ite->second.priority) --s_nr_bulk_jobs ;
+        s_pending_jobs.erase(ite) ;
+    }
+}
+
+// returns false if the result is not reproducible : sampling without a `seed` field
+static bool parse_decode_options(struct http_message *hm , DecodeOptions &opts , size_t &n)
+{
+    char value[32] ;
+    opts = s_default_decode_opts ;
+    n = 1U ;
+    if(mg_get_http_var(&hm->body , "n" , value , sizeof(value)) > 0)
+    {
+        n = max(1UL , min(strtoul(value , NULL , 10) , static_cast<unsigned long>(InferenceEngine::MaxBeamWidth))) ;
+    }
+    if(mg_get_http_var(&hm->body , "beam_width" , value , sizeof(value)) > 0)
+    {
+        unsigned long beam_width = strtoul(value , NULL , 10) ;
+        opts.beam_width = static_cast<unsigned>(max(1UL , min(beam_width , static_cast<unsigned long>(InferenceEngine::MaxBeamWidth)))) ;
+    }
+    if(mg_get_http_var(&hm->body , "temperature" , value , sizeof(value)) > 0) opts.sampling.temperature = max(0.f , strtof(value , NULL)) ;
+    if(mg_get_http_var(&hm->body , "top_k" , value , sizeof(value)) > 0) opts.sampling.top_k = strtoul(value , NULL , 10) ;
+    if(mg_get_http_var(&hm->body , "top_p" , value , sizeof(value)) > 0)
+    {
+        opts.sampling.top_p = max(0.f , min(1.f , strtof(value , NULL))) ;
+    }
+    if(mg_get_http_var(&hm->body , "shortlist" , value , sizeof(value)) > 0)
+    {
+        opts.use_shortlist = strtoul(value , NULL , 10) != 0UL ;
+    }
+    else if(n <= 1U && (opts.is_sampling() || opts.beam_width <= 1U))
+    {
+        // a shortlisted request can't join the batch , so the requests the scheduler takes don't use it by default ;
+        // the same whether a scheduler runs or not , the poem doesn't depend on `--max-batch-size`
+        opts.use_shortlist = false ;
+    }
+    // the option only matters when a shortlist is loaded
+    opts.use_shortlist = opts.use_shortlist && p_pgh->use_native_engine && p_pgh->engine.get_vocab_shortlist() ;
+    if(mg_get_http_var(&hm->body , "seed" , value , sizeof(value)) > 0)
+    {
+        opts.seed = strtoull(value , NULL , 10) ;
+        return true ;
+    }
+    opts.seed = s_seed_rng() ;
+    return !opts.is_sampling() ;
+}
+
+// greedy and sampling requests of one poem go to the batching scheduler , unless they use the shortlist ;
+// greedy ones of a line length with a compiled kernel are decoded by the kernel instead
+static bool is_batchable(const DecodeOptions &opts , size_t n , size_t sent_len)
+{
+    return n <= 1U && p_scheduler
+        && (opts.is_sampling() || (opts.beam_width <= 1U && !p_pgh->engine.has_greedy_kernel(sent_len))) ;
+}
+
+// `priority` field , else `X-Priority` header : `interactive` (default) or `bulk`
+static RequestPriority parse_priority(struct http_message *hm)
+{
+    char value[16] ;
+    if(mg_get_http_var(&hm->body , "priority" , value , sizeof(value)) > 0)
+    {
+        return 0 == strcmp(value , "bulk") ? RequestPriority::Bulk : RequestPriority::Interactive ;
+    }
+    struct mg_str *header = mg_get_http_header(hm , "X-Priority") ;
+    if(header && 0 == mg_vcmp(header , "bulk")) return RequestPriority::Bulk ;
+    return RequestPriority::Interactive ;
+}
+
+// `deadline_ms` field , else `X-Deadline-Ms` header , else `--default-deadline-ms` ; counted from now , at most `MaxDeadlineMs` .
+// returns false if the given one is negative or not a number
+static bool parse_deadline(struct http_message *hm , DecodeOptions &opts)
+{
+    char value[32] ;
+    string deadline_text ;
+    struct mg_str *header = mg_get_http_header(hm , "X-Deadline-Ms") ;
+    if(mg_get_http_var(&hm->body , "deadline_ms" , value , sizeof(value)) > 0) deadline_text = value ;
+    else if(header) deadline_text.assign(header->p , header->len) ;
+    long deadline_ms = s_default_deadline_ms ;
+    if(!deadline_text.empty())
+    {
+        char *end = NULL ;
+        deadline_ms = strtol(deadline_text.c_str() , &end , 10) ; // out of range gives LONG_MIN or LONG_MAX
+        if(end == deadline_text.c_str() || deadline_ms < 0L) return false ;
+    }
+    deadline_ms = min(deadline_ms , MaxDeadlineMs) ;
+    opts.deadline = deadline_ms > 0L ? chrono::steady_clock::now() + chrono::milliseconds(deadline_ms)
+        : chrono::steady_clock::time_point::max() ;
+    return true ;
+}
+
+static string make_cache_key(const string &first_seq , const DecodeOptions &opts , size_t n)
+{
+    // normalized first line (without spaces) plus every decoding parameter
+    vector<string> words ;
+    p_pgh->slice_utf8_sents2single_words(first_seq , words) ;
+    ostringstream oss ;
+    for(const string &word : words) oss << word ;
+    oss << "\tlines=" << p_pgh->poem_sent_num << "\tbeam_width=" << opts.beam_width << "\tshortlist=" << opts.use_shortlist << "\tn=" << n ;
+    if(opts.is_sampling())
+    {
+        oss << "\ttemperature=" << opts.sampling.temperature << "\ttop_k=" << opts.sampling.top_k
+            << "\ttop_p=" << opts.sampling.top_p << "\tseed=" << opts.seed ;
+    }
+    return oss.str() ;
+}
+
 static void rest_api(struct mg_connection *nc , struct http_message *hm)
 {
     char first_seq[256] ;
     mg_get_http_var(&hm->body , "first_seq" , first_seq , sizeof(first_seq)) ;
-    mg_printf(nc, "%s", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
-    if(first_seq[0] == '\0')
+    IndexSeq first_index_seq ;
+    if(first_seq[0] != '\0')
+    {
+        try
+        {
+            p_pgh->first_seq2index_seq(first_seq , first_index_seq) ;
+        }
+        catch(const utf8::exception &)
+        {
+            first_index_seq.clear() ; // not UTF-8 , or truncated by the buffer in the middle of a character
+        }
+    }
+    if(first_index_seq.empty())
     {
+        mg_printf(nc, "%s", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
         send_error_result(nc , "bad request") ;
+        return ;
     }
-    else
+    //mg_printf_http_chunk(nc , "request value : %s\n" , first_seq) ;
+    DecodeOptions opts ;
+    size_t n ;
+    bool is_reproducible = parse_decode_options(hm , opts , n) ;
+    if(!parse_deadline(hm , opts))
     {
-        //mg_printf_http_chunk(nc , "request value : %s\n" , first_seq) ;
-        vector<string> poem ;
-        p_pgh->generate(first_seq , poem) ;
-        for(string &sent : poem)
-        {
-            mg_printf_http_chunk(nc , "%s\n" , sent.c_str()) ;
-        }
+        send_bad_request_result(nc , "bad deadline") ;
+        return ;
+    }
+    if(opts.sampling.top_k > MaxSampleCandidates)
+    {
+        send_bad_request_result(nc , "bad top_k , at most 256") ;
+        return ;
+    }
+    vector<string> poem ;
+    // results of unseeded sampling are not cached
+    string cache_key = is_reproducible ? make_cache_key(first_seq , opts , n) : "" ;
+    if(!cache_key.empty() && p_response_cache->get(cache_key , poem))
+    {
+        send_poem_result(nc , poem) ;
+    }
+    else if(!generate_async(nc , first_seq , first_index_seq , opts , n , parse_priority(hm) , cache_key))
+    {
+        // a beam narrowed for the deadline is not what the key stands for , the result is not cached
+        bool is_narrowed = generate_response(first_seq , opts , n , poem) ;
+        if(!cache_key.empty() && !is_narrowed) p_response_cache->put(cache_key , poem) ;
+        send_poem_result(nc , poem) ;
     }
-    mg_send_http_chunk(nc , "" , 0) ; // end chunked
+}
+
+static void stats_api(struct mg_connection *nc)
+{
+    mg_printf(nc, "%s", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+    mg_printf_http_chunk(nc , "worker %u\n" , s_worker_idx) ;
+    mg_printf_http_chunk(nc , "response_cache_entries %lu\nresponse_cache_bytes %lu\n"
+            "response_cache_hits %llu\nresponse_cache_misses %llu\n" ,
+            static_cast<unsigned long>(p_response_cache->size()) , static_cast<unsigned long>(p_response_cache->bytes()) ,
+            p_response_cache->hits() , p_response_cache->misses()) ;
+    const EncoderStateCache *p_cache = p_pgh->engine.get_encoder_cache() ;
+    if(p_cache)
+    {
+        mg_printf_http_chunk(nc , "encoder_cache_size %lu\nencoder_cache_capacity %lu\n"
+                "encoder_cache_hits %llu\nencoder_cache_misses %llu\n" ,
+                static_cast<unsigned long>(p_cache->size()) , static_cast<unsigned long>(p_cache->capacity()) ,
+                p_cache->hits() , p_cache->misses()) ;
+    }
+    if(p_scheduler)
+    {
+        mg_printf_http_chunk(nc , "scheduler_active %lu\nscheduler_queued %lu\nscheduler_active_bulk %lu\nscheduler_queued_bulk %lu\n" ,
+                static_cast<unsigned long>(p_scheduler->active_size()) , static_cast<unsigned long>(p_scheduler->queued_size()) ,
+                static_cast<unsigned long>(p_scheduler->active_bulk_size()) , static_cast<unsigned long>(p_scheduler->queued_bulk_size())) ;
+    }
+    if(p_worker_pool)
+    {
+        mg_printf_http_chunk(nc , "worker_threads %lu\nworker_queued %lu\nworker_queued_bulk %lu\n" ,
+                static_cast<unsigned long>(p_worker_pool->size()) , static_cast<unsigned long>(p_worker_pool->queued()) ,
+                static_cast<unsigned long>(p_worker_pool->queued_bulk())) ;
+    }
+    mg_printf_http_chunk(nc , "pending_requests %lu\npending_bulk_requests %lu\nshed_in_flight %llu\nshed_queue_time %llu\n"
+            "deadline_exceeded %llu\n" ,
+            static_cast<unsigned long>(s_pending_jobs.size()) , static_cast<unsigned long>(s_nr_bulk_jobs) , s_shed_in_flight , s_shed_queue_time ,
+            s_deadline_exceeded) ;
+    if(p_pgh->use_native_engine) mg_printf_http_chunk(nc , "narrowed_beams %llu\n" , p_pgh->engine.narrowed_beam_count()) ;
+    mg_send_http_chunk(nc , "" , 0) ;
 }
 
 static void ev_handler(struct mg_connection *nc , int ev , void *ev_data)
@@ -136,11 +862,29 @@ static void ev_handler(struct mg_connection *nc , int ev , void *ev_data)
             {
                 rest_api(nc , hm) ;
             }
+            else if(0 == mg_vcmp(&hm->uri , "/stats"))
+            {
+                stats_api(nc) ;
+            }
             else
             {
                 send_error_result(nc , "bad url") ;
             }
             break ;
+        case MG_EV_CLOSE :
+            // drop the unfinished generation of a closed connection ,
+            // a job already running on a worker thread finishes and its result is dropped
+            for(auto ite = s_pending_jobs.begin() ; ite != s_pending_jobs.end() ; )
+            {
+                if(ite->second.nc == nc)
+                {
+                    if(ite->second.in_scheduler) p_scheduler->cancel(ite->first) ;
+                    if(RequestPriority::Bulk == ite->second.priority) --s_nr_bulk_jobs ;
+                    ite = s_pending_jobs.erase(ite) ;
+                }
+                else ++ite ;
+            }
+            break ;
         default :
             break ;
     }
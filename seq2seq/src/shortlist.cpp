@@ -0,0 +1,94 @@
+#include "shortlist.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <boost/archive/text_iarchive.hpp>
+#include <boost/archive/text_oarchive.hpp>
+#include <boost/serialization/vector.hpp>
+#include <boost/log/trivial.hpp>
+
+using namespace std;
+
+namespace
+{
+// the `k` most counted keys , descending by count , ties by index
+template <typename CountMap>
+IndexSeq top_k_by_count(const CountMap &counts, size_t k)
+{
+    vector<pair<unsigned long, Index>> sorted_counts;
+    sorted_counts.reserve(counts.size());
+    for (const auto &count : counts) sorted_counts.push_back(make_pair(count.second, count.first));
+    size_t nr_top = min(k, sorted_counts.size());
+    partial_sort(sorted_counts.begin(), sorted_counts.begin() + nr_top, sorted_counts.end(),
+        [](const pair<unsigned long, Index> &a, const pair<unsigned long, Index> &b)
+        {
+            return a.first > b.first || (a.first == b.first && a.second < b.second);
+        });
+    IndexSeq top(nr_top);
+    for (size_t idx = 0; idx < nr_top; ++idx) top[idx] = sorted_counts[idx].second;
+    return top;
+}
+}
+
+VocabShortlist::VocabShortlist()
+    :word_dict_size(0)
+{}
+
+void VocabShortlist::build(const vector<Poem> &poems, unsigned word_dict_size, size_t head_size, size_t per_word_size)
+{
+    this->word_dict_size = word_dict_size;
+    unordered_map<Index, unsigned long> word_counts;
+    vector<unordered_map<Index, unsigned long>> cooccurrence_counts(word_dict_size);
+    for (const Poem &poem : poems)
+    {
+        if (poem.empty()) continue;
+        for (const IndexSeq &sent : poem)
+        {
+            for (Index word : sent) ++word_counts[word];
+        }
+        for (Index first_word : poem[0])
+        {
+            if (first_word < 0 || first_word >= static_cast<Index>(word_dict_size)) continue;
+            unordered_map<Index, unsigned long> &counts = cooccurrence_counts[first_word];
+            for (size_t sent_idx = 1; sent_idx < poem.size(); ++sent_idx)
+            {
+                for (Index word : poem[sent_idx]) ++counts[word];
+            }
+        }
+    }
+    head = top_k_by_count(word_counts, head_size);
+    cooccurrence.assign(word_dict_size, IndexSeq());
+    for (unsigned word = 0; word < word_dict_size; ++word)
+    {
+        cooccurrence[word] = top_k_by_count(cooccurrence_counts[word], per_word_size);
+    }
+    BOOST_LOG_TRIVIAL(info) << "shortlist built from " << poems.size() << " poems , head size " << head.size()
+        << " , co-occurrence list size " << per_word_size;
+}
+
+void VocabShortlist::candidates(const IndexSeq &first_seq, IndexSeq &words) const
+{
+    IndexSeq tmp_words(head);
+    for (Index first_word : first_seq)
+    {
+        if (first_word < 0 || first_word >= static_cast<Index>(cooccurrence.size())) continue;
+        const IndexSeq &cooccurrence_words = cooccurrence[first_word];
+        tmp_words.insert(tmp_words.end(), cooccurrence_words.begin(), cooccurrence_words.end());
+    }
+    sort(tmp_words.begin(), tmp_words.end());
+    tmp_words.erase(unique(tmp_words.begin(), tmp_words.end()), tmp_words.end());
+    swap(tmp_words, words);
+}
+
+void VocabShortlist::save(ostream &os) const
+{
+    boost::archive::text_oarchive to(os);
+    to << word_dict_size << head << cooccurrence;
+}
+
+void VocabShortlist::load(istream &is)
+{
+    boost::archive::text_iarchive ti(is);
+    ti >> word_dict_size >> head >> cooccurrence;
+    BOOST_LOG_TRIVIAL(info) << "shortlist loaded , head size " << head.size();
+}
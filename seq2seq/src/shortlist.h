@@ -0,0 +1,35 @@
+#ifndef SHORTLIST_H_INCLUDED
+#define SHORTLIST_H_INCLUDED
+#include <vector>
+#include <iostream>
+
+#include "typedec.h"
+
+/*
+ * Vocabulary shortlist for the decoder output projection .
+ * learned from the training corpus : the most frequent words (head) , and for every word ,
+ * the words that most often appear in the following lines of poems whose first line contains it .
+ * the candidate set of a request is the head plus the co-occurring words of every first line word .
+ */
+class VocabShortlist
+{
+public:
+    VocabShortlist();
+
+    void build(const std::vector<Poem> &poems, unsigned word_dict_size, std::size_t head_size, std::size_t per_word_size);
+    // sorted , unique candidate words for a first line
+    void candidates(const IndexSeq &first_seq, IndexSeq &words) const;
+
+    void save(std::ostream &os) const;
+    void load(std::istream &is);
+
+    unsigned get_word_dict_size() const { return word_dict_size; }
+    std::size_t get_head_size() const { return head.size(); }
+
+private:
+    unsigned word_dict_size;
+    IndexSeq head;
+    std::vector<IndexSeq> cooccurrence; // per word , descending by count
+};
+
+#endif
@@ -4,4 +4,10 @@
 using Index = int;
 using IndexSeq = std::vector<Index>;
 using Poem = std::vector<IndexSeq>;
+// queued interactive requests go before bulk ones
+enum class RequestPriority
+{
+    Interactive,
+    Bulk
+};
 #endif
@@ -0,0 +1,58 @@
+#include "worker_pool.h"
+
+using namespace std;
+
+WorkerPool::WorkerPool(size_t nr_threads)
+    :stopping(false)
+{
+    for (size_t thread_idx = 0; thread_idx < nr_threads; ++thread_idx) workers.push_back(thread(&WorkerPool::run, this));
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        stopping = true;
+        tasks.clear();
+        bulk_tasks.clear();
+    }
+    task_cv.notify_all();
+    for (thread &worker : workers) worker.join();
+}
+
+void WorkerPool::submit(function<void()> task, RequestPriority priority)
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        (RequestPriority::Bulk == priority ? bulk_tasks : tasks).push_back(std::move(task));
+    }
+    task_cv.notify_one();
+}
+
+size_t WorkerPool::queued() const
+{
+    lock_guard<mutex> lock(mtx);
+    return tasks.size() + bulk_tasks.size();
+}
+
+size_t WorkerPool::queued_bulk() const
+{
+    lock_guard<mutex> lock(mtx);
+    return bulk_tasks.size();
+}
+
+void WorkerPool::run()
+{
+    unique_lock<mutex> lock(mtx);
+    while (true)
+    {
+        task_cv.wait(lock, [this]{ return stopping || !tasks.empty() || !bulk_tasks.empty(); });
+        if (stopping) return;
+        deque<function<void()>> &queue = tasks.empty() ? bulk_tasks : tasks;
+        function<void()> task = std::move(queue.front());
+        queue.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
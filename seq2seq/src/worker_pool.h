@@ -0,0 +1,42 @@
+#ifndef WORKER_POOL_H_INCLUDED
+#define WORKER_POOL_H_INCLUDED
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "typedec.h"
+
+/*
+ * Fixed pool of worker threads running queued tasks in submission order , e.g. generation requests taken off the
+ * server event loop . a task posts its own result back , the pool knows nothing about it .
+ * a free thread takes the queued interactive tasks before any bulk one ; a running task is never preempted .
+ */
+class WorkerPool
+{
+public:
+    explicit WorkerPool(std::size_t nr_threads);
+    // drops the queued tasks and waits for the running ones
+    ~WorkerPool();
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool &operator=(const WorkerPool&) = delete;
+
+    void submit(std::function<void()> task, RequestPriority priority = RequestPriority::Interactive);
+    std::size_t size() const { return workers.size(); }
+    std::size_t queued() const;
+    std::size_t queued_bulk() const;
+
+private:
+    mutable std::mutex mtx;
+    std::condition_variable task_cv;
+    std::deque<std::function<void()>> tasks;
+    std::deque<std::function<void()>> bulk_tasks;
+    bool stopping;
+    std::vector<std::thread> workers;
+
+    void run();
+};
+
+#endif